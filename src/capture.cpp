@@ -0,0 +1,162 @@
+#include "project.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+#include "trace.h"
+
+#define CAPTURE_FLUSH_INTERVAL 100  // Time in ms after which the buffered records are written to the capture file
+
+namespace Capture {
+
+    static const chrono::steady_clock::time_point startTime = chrono::steady_clock::now();
+    static FILE *captureFile = NULL;   // Opened by the first record (kept open, stdio buffers the writes)
+    static bool openFailed = false;
+    static bool closed = false;        // close() has been called (no more records are written)
+    static bool flushRequired = false; // Records have been written since the last flush
+    static mutex captureLock;          // Serializes records of concurrent tuner threads
+    static atomic<uint32_t> threadCount(0);
+
+    // Flusher thread, started when the file is opened, so that a crash loses at most CAPTURE_FLUSH_INTERVAL ms of records
+    // Created on first use, like the log writer thread
+    class Flusher {
+    public:
+        ~Flusher() { close(); }  // A joinable thread must not be destroyed
+        thread worker;
+        condition_variable event;
+    };
+
+    static Flusher &flusher(void)
+    {
+        static Flusher f;
+        return f;
+    }
+
+    // Flusher thread main loop
+    static void run(void)
+    {
+        unique_lock<mutex> lock(captureLock);
+        while (!closed) {
+            flusher().event.wait_for(lock, chrono::milliseconds(CAPTURE_FLUSH_INTERVAL));
+            if (flushRequired) {
+                fflush(captureFile);
+                flushRequired = false;
+            }
+        }
+    }
+
+    // Cut off a record left incomplete by a crash, so that the records appended after it can still be read
+    // fp must be positioned on the first record
+    static bool truncate_broken_record(FILE *fp)
+    {
+        Trace::APDU_t a;
+        long end = ftell(fp);
+        while (Trace::read_record(fp, &a)) end = ftell(fp);
+
+        fseek(fp, 0, SEEK_END);
+        if (ftell(fp) == end) return true;
+        if (fflush(fp) != 0) return false;
+#ifdef _WIN32
+        return (_chsize_s(_fileno(fp), end) == 0);
+#else
+        return (ftruncate(fileno(fp), end) == 0);
+#endif
+    }
+
+    // Open the capture file
+    // The binary log is a history kept across library loads, so it is appended to (a file of another format version is
+    // started over), while the APDU capture of each session starts a new file
+    static FILE *open_file(void)
+    {
+        string name(sys.CAPTURE_FILE_NAME);
+        if (sys.logMode & LOG_BINARY) {
+            FILE *fp = fopen(name.c_str(), "a+b");
+            if (!fp) return NULL;
+            fseek(fp, 0, SEEK_END);
+            bool empty = (ftell(fp) == 0);
+            rewind(fp);
+            if (empty ? Trace::write_header(fp) : (Trace::read_header(fp) && truncate_broken_record(fp))) {
+                fseek(fp, 0, SEEK_END);  // Required between a read and a write
+                return fp;
+            }
+            fclose(fp);
+        }
+
+        FILE *fp = fopen(name.c_str(), "wb");
+        if (fp && !Trace::write_header(fp)) {
+            fclose(fp);
+            fp = NULL;
+        }
+        return fp;
+    }
+
+    // Small sequential number of the calling thread (1~)
+    static uint32_t thread_number(void)
+    {
+        static thread_local uint32_t number = 0;
+        if (!number) number = ++threadCount;
+        return number;
+    }
+
+    uint64_t timestamp(void)
+    {
+        return (uint64_t)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - startTime).count();
+    }
+
+    // Append a command and its response to the capture file (*.trc)
+    // timestamp is the time the command was received, the latency is measured up to this call
+    void record(const uint8_t *command, uint32_t commandLength, const uint8_t *response, uint32_t responseLength, uint64_t timestamp)
+    {
+        uint64_t latency = Capture::timestamp() - timestamp;
+
+        Trace::APDU_t a;
+        a.timestamp = timestamp;
+        a.threadID = thread_number();
+        a.latency = (uint32_t)((latency < UINT32_MAX) ? latency : UINT32_MAX);
+        a.ins = ctx.INS;
+        a.returnCode = (ctx.INS && (responseLength >= 8)) ? ld_be16(&response[4]) : 0;  // Behind the protocol number, unit length and IC card instruction
+        a.commandLength = (uint16_t)((commandLength < TRACE_APDU_MAX_LENGTH) ? commandLength : TRACE_APDU_MAX_LENGTH);
+        a.responseLength = (uint16_t)((responseLength < TRACE_APDU_MAX_LENGTH) ? responseLength : TRACE_APDU_MAX_LENGTH);
+        memcpy(a.command, command, a.commandLength);
+        memcpy(a.response, response, a.responseLength);
+
+        lock_guard<mutex> lock(captureLock);
+        if (!captureFile) {
+            if (openFailed || closed) return;
+            captureFile = open_file();
+            if (!captureFile) {
+                openFailed = true;
+                return;
+            }
+            Utils::pin_module();
+            flusher().worker = thread(run);
+        }
+        Trace::write_record(captureFile, a);
+        flushRequired = true;
+    }
+
+    // Stop the flusher thread, write the buffered records and close the capture file
+    void close(void)
+    {
+        bool started;
+        {
+            lock_guard<mutex> lock(captureLock);
+            if (closed) return;
+            closed = true;
+            started = (captureFile != NULL);
+        }
+        if (!started) return;
+
+        flusher().event.notify_one();
+        if (!Utils::finish_writer_thread(flusher().worker, captureLock)) return;
+        fclose(captureFile);
+        captureFile = NULL;
+        captureLock.unlock();
+    }
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+namespace Capture {
+
+    uint64_t timestamp(void);  // Nanoseconds since the library was loaded
+    void record(const uint8_t *command, uint32_t commandLength, const uint8_t *response, uint32_t responseLength, uint64_t timestamp);
+    void close(void);
+}
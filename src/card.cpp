@@ -12,73 +12,73 @@ namespace Cas {
         loadCardImage(sys.initGroupID, sys.initGroupIDKm);
 
         // Check tier area
-        Log::logout("    Checking check digits for each contract information section: ");
+        LOGOUT("    Checking check digits for each contract information section: ");
         bool err = false;
         for (uint8_t BroadcastGroupID = 0; BroadcastGroupID <= BGID_COUNT; BroadcastGroupID++) {
             TIER_t *p = pTIER(BroadcastGroupID);
             uint8_t checkDigit = Utils::calc_tier_check_digit(p);
             if (p->checkDigit != checkDigit) {
-                if (!err) Log::logout("\n");
-                Log::logout("\n");
-                Log::logout("        Broadcast group ID: 0x%02X (%s)\n", BroadcastGroupID, Utils::BroadcastGroupID_to_name(BroadcastGroupID));
-                Log::logout("            ");
+                if (!err) LOGOUT("\n");
+                LOGOUT("\n");
+                LOGOUT("        Broadcast group ID: 0x%02X (%s)\n", BroadcastGroupID, Utils::BroadcastGroupID_to_name(BroadcastGroupID));
+                LOGOUT("            ");
                 Log::logout_dump(p, sizeof(TIER_t), 3);
-                Log::logout("        Check digit mismatch: Incorrect: 0x%02X / Correct: 0x%02X\n", p->checkDigit, checkDigit);
+                LOGOUT("        Check digit mismatch: Incorrect: 0x%02X / Correct: 0x%02X\n", p->checkDigit, checkDigit);
                 err = true;
             }
         }
 
         if (!err) {
-            Log::logout("OK\n");
+            LOGOUT("OK\n");
         } else {
-            Log::logout("\n");
+            LOGOUT("\n");
         }
 
         // Check message area
-        Log::logout("    Checking check digits for each message control section: ");
+        LOGOUT("    Checking check digits for each message control section: ");
         err = false;
         for (uint8_t BroadcastGroupID = 0; BroadcastGroupID <= BGID_COUNT; BroadcastGroupID++) {
             MESSAGE_t *p = pMESSAGE(BroadcastGroupID);
             uint8_t checkDigit = Utils::calc_message_check_digit(p);
             if (p->checkDigit != checkDigit) {
-                if (!err) Log::logout("\n");
-                Log::logout("\n");
-                Log::logout("        Broadcast group ID: 0x%02X (%s)\n", BroadcastGroupID, Utils::BroadcastGroupID_to_name(BroadcastGroupID));
-                Log::logout("            ");
+                if (!err) LOGOUT("\n");
+                LOGOUT("\n");
+                LOGOUT("        Broadcast group ID: 0x%02X (%s)\n", BroadcastGroupID, Utils::BroadcastGroupID_to_name(BroadcastGroupID));
+                LOGOUT("            ");
                 Log::logout_dump(p, sizeof(MESSAGE_t), 3);
-                Log::logout("        Check digit mismatch: Incorrect: 0x%02X / Correct: 0x%02X\n",p->checkDigit, checkDigit);
+                LOGOUT("        Check digit mismatch: Incorrect: 0x%02X / Correct: 0x%02X\n",p->checkDigit, checkDigit);
                 err = true;
             }
         }
 
         if (!err) {
-            Log::logout("OK\n");
+            LOGOUT("OK\n");
         } else {
-            Log::logout("\n");
+            LOGOUT("\n");
         }
 
         // Log output of Card ID & Group ID
-        Log::logout("\n");
+        LOGOUT("\n");
         Cas::GROUP_ID_t *p = (Cas::GROUP_ID_t *)(pINFO()->ID);
         for (int i = 0; i <= 7; i++) {
             if (!i || (pINFO()->GroupID_Flag2 & (1 << i))) {
                 if (i == 0) {
-                    Log::logout("    Main card ID: 0x%012llX [%04X] (%s)", ld_be48(p->ID), ld_be16(p->ID_CheckDigit), Utils::cardID_to_string(ld_be48(p->ID)));
-                    if (Utils::calc_cardID_check_digit(ld_be48(p->ID)) != ld_be16(p->ID_CheckDigit)) Log::logout("  * Check digit mismatch");
-                    Log::logout("\n");
+                    LOGOUT("    Main card ID: 0x%012llX [%04X] (%s)", ld_be48(p->ID), ld_be16(p->ID_CheckDigit), Utils::cardID_to_string(ld_be48(p->ID)));
+                    if (Utils::calc_cardID_check_digit(ld_be48(p->ID)) != ld_be16(p->ID_CheckDigit)) LOGOUT("  * Check digit mismatch");
+                    LOGOUT("\n");
                 } else {
-                    Log::logout("\n");
-                    Log::logout("        Group ID [%u]: 0x%012llX [%04X] (%s)", i, ld_be48(p->ID), ld_be16(p->ID_CheckDigit), Utils::cardID_to_string(ld_be48(p->ID)));
-                    if (Utils::calc_cardID_check_digit(ld_be48(p->ID)) != ld_be16(p->ID_CheckDigit)) Log::logout("  * Check digit mismatch");
-                    Log::logout("\n");
+                    LOGOUT("\n");
+                    LOGOUT("        Group ID [%u]: 0x%012llX [%04X] (%s)", i, ld_be48(p->ID), ld_be16(p->ID_CheckDigit), Utils::cardID_to_string(ld_be48(p->ID)));
+                    if (Utils::calc_cardID_check_digit(ld_be48(p->ID)) != ld_be16(p->ID_CheckDigit)) LOGOUT("  * Check digit mismatch");
+                    LOGOUT("\n");
                 }
             }
             p++;
         }
-        Log::logout("\n");
+        LOGOUT("\n");
 
         // Log output of work key information
-        Log::logout("    Work key information:\n");
+        LOGOUT("    Work key information:\n");
         long keyCount = 0;
         vector<KeyManager::Kw_t> keyList;
         for (uint8_t BroadcastGroupID = 0; BroadcastGroupID < BGID_COUNT; BroadcastGroupID++) {
@@ -98,20 +98,20 @@ namespace Cas {
             sys.keySets.getWorkKeyList(BroadcastGroupID, keyList);  // Create a list of registered work keys
             if (keyList.size() == 0) continue;
 
-            Log::logout("        Broadcast group ID: 0x%02X (%s)\n", BroadcastGroupID, Utils::BroadcastGroupID_to_name(BroadcastGroupID));
+            LOGOUT("        Broadcast group ID: 0x%02X (%s)\n", BroadcastGroupID, Utils::BroadcastGroupID_to_name(BroadcastGroupID));
             for (int i = 0; i < (int)keyList.size(); i++) {
-                Log::logout("            Kw%02X = %02X %016llX\n", BroadcastGroupID, keyList[i].WorkKeyID, keyList[i].Key);
+                LOGOUT("            Kw%02X = %02X %016llX\n", BroadcastGroupID, keyList[i].WorkKeyID, keyList[i].Key);
                 keyCount++;
             }
-            Log::logout("\n");
+            LOGOUT("\n");
         }
 
         keyList.clear();
         if (!keyCount) {
-            Log::logout("        * No work key information\n");
+            LOGOUT("        * No work key information\n");
         }
 
-        Log::logout(NULL);  // Flush the log file stream
+        LOGOUT(NULL);  // Flush the log file stream
     }
 
     Card::~Card()
@@ -155,18 +155,19 @@ namespace Cas {
     }
 
     // Read card image file into buffer (7680 bytes)
+    // Updates of other handles still waiting in the image writer are included
     void Card::loadCardImage(uint64_t *initID, uint64_t *initKm)
     {
         // Load card image file (create default file in case of failure)
         if (!sys.clModeEnable) {
             bool resetFlag = false;
-            if (!Utils::load_card_image(cardImage)) {
+            if (!sys.imageWriter.load(cardImage)) {
                 resetFlag = true;
                 memcpy(cardImage, DEFAULT_CARD_IMAGE, sizeof(cardImage));
                 setupCardImage(initID, initKm);
-                Utils::save_card_image(cardImage);
+                sys.imageWriter.create(cardImage);
             }
-            Log::logout("    %s\n", resetFlag ? "Default values have been applied to the card image file." : "Existing card image file loaded.");
+            LOGOUT("    %s\n", resetFlag ? "Default values have been applied to the card image file." : "Existing card image file loaded.");
             return;
         }
 
@@ -175,28 +176,72 @@ namespace Cas {
         setupCardImage(initID, initKm);
     }
 
-    // Writes data in buffer to card image file (7680 bytes)
+    // Queue the buffer to be written to the card image file (7680 bytes) if it has been modified since the last save
+    // The file itself is written by the image writer thread
     void Card::saveCardImage(void)
     {
+        if (!dirty.count) return;
+        DirtyRanges ranges = dirty;
+        dirty.count = 0;
+
         if (sys.clModeEnable) return;
 
-        uint8_t tmp[sizeof(cardImage)];
-        bool update = false;
-        if (Utils::load_card_image(tmp)) {
-            update = (memcmp(tmp, cardImage, sizeof(tmp)) != 0);
-        }
+        sys.imageWriter.publish(cardImage, ranges);
+        LOGOUT("[Card image file update queued]\n");
+    }
 
-        if (update) {
-            if (!Utils::save_card_image(cardImage)) {
-                Log::logout("[Failed to update card image file]\n");
-            } else {
-                Log::logout("[Card image file updated]\n");
+    // Record the modified range of the card image
+    void Card::markDirty(const void *p, size_t size)
+    {
+        uint16_t begin = (uint16_t)((const uint8_t *)p - cardImage);
+        dirty.add(begin, (uint16_t)(begin + size));
+        imageGeneration++;
+    }
+
+    void DirtyRanges::add(uint16_t begin, uint16_t end)
+    {
+        for (int i = 0; i < count; i++) {
+            RANGE_t *r = &range[i];
+            if ((begin <= r->end) && (end >= r->begin)) {
+                if (begin < r->begin) r->begin = begin;
+                if (end > r->end) r->end = end;
+                return;
             }
         }
+
+        if (count < DIRTY_RANGE_COUNT) {
+            range[count].begin = begin;
+            range[count].end = end;
+            count++;
+            return;
+        }
+
+        // No free entry: collapse everything into a single range
+        RANGE_t *r = &range[0];
+        for (int i = 1; i < count; i++) {
+            if (range[i].begin < r->begin) r->begin = range[i].begin;
+            if (range[i].end > r->end) r->end = range[i].end;
+        }
+        if (begin < r->begin) r->begin = begin;
+        if (end > r->end) r->end = end;
+        count = 1;
+    }
+
+    void DirtyRanges::add(const DirtyRanges &ranges)
+    {
+        for (int i = 0; i < ranges.count; i++) add(ranges.range[i].begin, ranges.range[i].end);
+    }
+
+    // Write data to the card image and record the modified range only if the contents actually change
+    void Card::writeCardImage(void *dst, const void *src, size_t size)
+    {
+        if (!memcmp(dst, src, size)) return;
+        memmove(dst, src, size);
+        markDirty(dst, size);
     }
 
     // Copy response data to create a return value for the API
-    static LONG resCopy(LPBYTE pbRecvBuffer, LPDWORD pcbRecvLength, void *res, DWORD resSize)
+    static LONG resCopy(LPBYTE pbRecvBuffer, LPDWORD pcbRecvLength, const void *res, DWORD resSize)
     {
         LONG result = SCARD_E_INVALID_PARAMETER;
         if ((*pcbRecvLength == 0) || (*pcbRecvLength >= resSize)) {
@@ -207,6 +252,64 @@ namespace Cas {
         return result;
     }
 
+    // Get the expanded key for (key, protocol), replacing the least recently used entry if it is not cached
+    const Crypto::KeyContext &Card::getKeyContext(uint64_t key, uint8_t protocol)
+    {
+        int victim = 0;
+        for (int i = 0; i < KEY_CACHE_COUNT; i++) {
+            if (keyCacheStamp[i] && (keyCache[i].key == key) && (keyCache[i].protocol == protocol)) {
+                keyCacheStamp[i] = ++keyCacheClock;
+                return keyCache[i];
+            }
+            if (keyCacheStamp[i] < keyCacheStamp[victim]) victim = i;
+        }
+
+        Crypto::init_key(&keyCache[victim], key, protocol);
+        keyCacheStamp[victim] = ++keyCacheClock;
+        return keyCache[victim];
+    }
+
+    // FNV-1a hash of the ECM command
+    static uint32_t calc_ecm_hash(const uint8_t *p, DWORD size)
+    {
+        uint32_t hash = 0x811c9dc5;
+        for (DWORD i = 0; i < size; i++) hash = (hash ^ p[i]) * 0x01000193;
+        return hash;
+    }
+
+    // Return the cached response if the identical ECM was processed with the current card image
+    bool Card::replayEcmCache(uint8_t BroadcastGroupID, LPCBYTE pbSendBuffer, DWORD cbSendLength, LPBYTE pbRecvBuffer, LPDWORD pcbRecvLength, LONG *result)
+    {
+        uint32_t hash = calc_ecm_hash(pbSendBuffer, cbSendLength);
+        for (uint8_t i = 0; i < ECM_CACHE_WAYS; i++) {
+            ECM_CACHE_t *e = &ecmCache[BroadcastGroupID][i];
+            if (!e->valid || (e->hash != hash) || (e->generation != imageGeneration)) continue;
+            if ((e->cmdLength != cbSendLength) || memcmp(e->cmd, pbSendBuffer, cbSendLength)) continue;
+
+            ecmCacheLastUsed[BroadcastGroupID] = i;
+            *result = resCopy(pbRecvBuffer, pcbRecvLength, e->res, e->resLength);
+            return true;
+        }
+        return false;
+    }
+
+    // Store the ECM response, replacing the least recently used entry of the broadcast group ID
+    void Card::storeEcmCache(uint8_t BroadcastGroupID, uint64_t generation, LPCBYTE pbSendBuffer, DWORD cbSendLength, const uint8_t *res, DWORD resSize)
+    {
+        if ((cbSendLength > sizeof(ecmCache[0][0].cmd)) || (resSize > sizeof(ecmCache[0][0].res))) return;
+
+        uint8_t i = (ecmCacheLastUsed[BroadcastGroupID] + 1) % ECM_CACHE_WAYS;
+        ECM_CACHE_t *e = &ecmCache[BroadcastGroupID][i];
+        e->valid = true;
+        e->hash = calc_ecm_hash(pbSendBuffer, cbSendLength);
+        e->generation = generation;
+        e->cmdLength = (uint8_t)cbSendLength;
+        memcpy(e->cmd, pbSendBuffer, cbSendLength);
+        e->resLength = (uint8_t)resSize;
+        memcpy(e->res, res, resSize);
+        ecmCacheLastUsed[BroadcastGroupID] = i;
+    }
+
     // Set 2 bytes of response data to create the API return value
     static LONG resError(LPBYTE pbRecvBuffer, LPDWORD pcbRecvLength, uint16_t returnCode)
     {
@@ -215,6 +318,25 @@ namespace Cas {
         return resCopy(pbRecvBuffer, pcbRecvLength, buf, sizeof(buf));
     }
 
+    // Area to build the response in (zero-filled up to resMax, the largest response of the command)
+    // This is the receive buffer itself when it can hold resMax bytes and does not overlap the command, otherwise the scratch area
+    static uint8_t *resArea(LPBYTE pbRecvBuffer, LPDWORD pcbRecvLength, LPCBYTE pbSendBuffer, DWORD cbSendLength, uint8_t *scratch, DWORD resMax)
+    {
+        bool fits = (*pcbRecvLength == 0) || (*pcbRecvLength >= resMax);
+        bool overlap = (pbRecvBuffer < pbSendBuffer + cbSendLength) && (pbSendBuffer < pbRecvBuffer + resMax);
+        uint8_t *res = (fits && !overlap) ? pbRecvBuffer : scratch;
+        memset(res, 0x00, resMax);
+        return res;
+    }
+
+    // Create the API return value for a response built in the area from resArea()
+    static LONG resReturn(LPBYTE pbRecvBuffer, LPDWORD pcbRecvLength, const void *res, DWORD resSize)
+    {
+        if (res != pbRecvBuffer) return resCopy(pbRecvBuffer, pcbRecvLength, res, resSize);
+        *pcbRecvLength = resSize;
+        return SCARD_S_SUCCESS;
+    }
+
     // INT: Initial setting conditions command
     LONG Card::processCmd30(LPCBYTE pbSendBuffer, DWORD cbSendLength, LPBYTE pbRecvBuffer, LPDWORD pcbRecvLength)
     {
@@ -257,25 +379,25 @@ namespace Cas {
 
         CMD *cmd = (CMD *)pbSendBuffer;
 
-        uint8_t recvTemp[300] = { 0 };
-        RES *res = (RES *)recvTemp;
+        uint8_t recvTemp[sizeof(RES)];
+        RES *res = (RES *)resArea(pbRecvBuffer, pcbRecvLength, pbSendBuffer, cbSendLength, recvTemp, sizeof(recvTemp));
         DWORD resSize = sizeof(RES);
 
-        Log::logout("[INT command received]\n");
+        LOGOUT("[INT command received]\n");
 
         if ((cbSendLength != sizeof(CMD)) || (cmd->Le != 0x00)) {
-            Log::logout("    Command length abnormal\n");
+            LOGOUT("    Command length abnormal\n");
             return resError(pbRecvBuffer, pcbRecvLength, 0x6700);
         }
 
         if (cmd->P1 || cmd->P2) {
-            Log::logout("    P1 / P2 abnormal: [ P1:0x%02X / P2: 0x%02X ]\n", cmd->P1, cmd->P2);
+            LOGOUT("    P1 / P2 abnormal: [ P1:0x%02X / P2: 0x%02X ]\n", cmd->P1, cmd->P2);
             return resError(pbRecvBuffer, pcbRecvLength, 0x6A86);
         }
 
         uint8_t Le = *(pbSendBuffer + cbSendLength - 1);
         if (Le) {
-            Log::logout("    Le abnormal: 0x%02X\n", Le);
+            LOGOUT("    Le abnormal: 0x%02X\n", Le);
             return resError(pbRecvBuffer, pcbRecvLength, 0x6700);
         }
 
@@ -293,27 +415,27 @@ namespace Cas {
         st_be16(res->system_management_id0, 0x0201);  // Broadcast/non-broadcast type: Broadcasting / Details type: 01
         st_be16(&res->SW1, swCode);
 
-        Log::logout("    CA system ID                  : 0x%04X\n", ld_be16(res->ca_system_id));
-        Log::logout("    Card ID                       : 0x%012llX (%s)\n", ld_be48(res->card_id), Utils::cardID_to_string(ld_be48(res->card_id)));
-        Log::logout("    Card Type                     : 0x%02X\n", res->card_type);
-        Log::logout("    Message split length          : 0x%02X (%u)\n", res->split_size, res->split_size);
+        LOGOUT("    CA system ID                  : 0x%04X\n", ld_be16(res->ca_system_id));
+        LOGOUT("    Card ID                       : 0x%012llX (%s)\n", ld_be48(res->card_id), Utils::cardID_to_string(ld_be48(res->card_id)));
+        LOGOUT("    Card Type                     : 0x%02X\n", res->card_type);
+        LOGOUT("    Message split length          : 0x%02X (%u)\n", res->split_size, res->split_size);
 
-        Log::logout("    Descrambler system key        : ");
-        for (int i = 0;i < 32;i++) Log::logout((i && !(i % 8)) ? " %02X" : "%02X", res->system_key[i]);
-        Log::logout("\n");
+        LOGOUT("    Descrambler system key        : ");
+        for (int i = 0;i < 32;i++) LOGOUT((i && !(i % 8)) ? " %02X" : "%02X", res->system_key[i]);
+        LOGOUT("\n");
 
-        Log::logout("    Descrambler CBC initial value : ");
-        for (int i = 0;i < 8;i++) Log::logout((i && !(i % 8)) ? " %02X" : "%02X", res->cbc[i]);
-        Log::logout("\n");
+        LOGOUT("    Descrambler CBC initial value : ");
+        for (int i = 0;i < 8;i++) LOGOUT((i && !(i % 8)) ? " %02X" : "%02X", res->cbc[i]);
+        LOGOUT("\n");
 
-        Log::logout("    System management ID count    : 0x%02X\n", res->system_management_id_count);
-        Log::logout("    Broadcast/non-broadcast type  : 0x%02X\n", res->system_management_id0[0] >> 4);
-        Log::logout("    Broadcast standard type       : 0x%02X\n", res->system_management_id0[0] & 0x0f);
-        Log::logout("    Details type                  : 0x%02X\n", res->system_management_id0[1]);
+        LOGOUT("    System management ID count    : 0x%02X\n", res->system_management_id_count);
+        LOGOUT("    Broadcast/non-broadcast type  : 0x%02X\n", res->system_management_id0[0] >> 4);
+        LOGOUT("    Broadcast standard type       : 0x%02X\n", res->system_management_id0[0] & 0x0f);
+        LOGOUT("    Details type                  : 0x%02X\n", res->system_management_id0[1]);
 
-        Log::logout("    Return code                   : 0x%04X\n", returnCode);
+        LOGOUT("    Return code                   : 0x%04X\n", returnCode);
 
-        return resCopy(pbRecvBuffer, pcbRecvLength, recvTemp, resSize);
+        return resReturn(pbRecvBuffer, pcbRecvLength, res, resSize);
     }
 
     // IDI: Get card ID information command
@@ -350,25 +472,25 @@ namespace Cas {
 
         CMD *cmd = (CMD *)pbSendBuffer;
 
-        uint8_t recvTemp[300] = { 0 };
-        RES *res = (RES *)recvTemp;
+        uint8_t recvTemp[sizeof(RES) + 7 * sizeof(RES_ID)];
+        RES *res = (RES *)resArea(pbRecvBuffer, pcbRecvLength, pbSendBuffer, cbSendLength, recvTemp, sizeof(recvTemp));
         DWORD resSize = sizeof(RES);
 
-        Log::logout("[IDI command received]\n");
+        LOGOUT("[IDI command received]\n");
 
         if ((cbSendLength != sizeof(CMD)) || (cmd->Le != 0x00)) {
-            Log::logout("    Command length abnormal\n");
+            LOGOUT("    Command length abnormal\n");
             return resError(pbRecvBuffer, pcbRecvLength, 0x6700);
         }
 
         if (cmd->P1 || cmd->P2) {
-            Log::logout("    P1 / P2 abnormal: [ P1:0x%02X / P2: 0x%02X ]\n", cmd->P1, cmd->P2);
+            LOGOUT("    P1 / P2 abnormal: [ P1:0x%02X / P2: 0x%02X ]\n", cmd->P1, cmd->P2);
             return resError(pbRecvBuffer, pcbRecvLength, 0x6A86);
         }
 
         uint8_t Le = *(pbSendBuffer + cbSendLength - 1);
         if (Le) {
-            Log::logout("    Le abnormal: 0x%02X\n", Le);
+            LOGOUT("    Le abnormal: 0x%02X\n", Le);
             return resError(pbRecvBuffer, pcbRecvLength, 0x6700);
         }
 
@@ -399,27 +521,27 @@ namespace Cas {
         st_be16((uint8_t *)p, swCode);
         resSize = sizeof(RES) + ((res->CardID_count - 1) * sizeof(RES_ID));
 
-        Log::logout("    Card ID count  : %u\n", res->CardID_count);
-        Log::logout("    Maker ID       : %c (0x%02X)\n", res->ID.Maker, res->ID.Maker);
-        Log::logout("    Version number : 0x%02X\n", res->ID.Version);
-        Log::logout("    Card ID        : 0x%012llX (%s)\n", ld_be48(res->ID.CardID), Utils::cardID_to_string(ld_be48(res->ID.CardID)));
-        Log::logout("    Check digit    : 0x%04X (%u)\n", ld_be16(res->ID.CheckDigit), ld_be16(res->ID.CheckDigit));
+        LOGOUT("    Card ID count  : %u\n", res->CardID_count);
+        LOGOUT("    Maker ID       : %c (0x%02X)\n", res->ID.Maker, res->ID.Maker);
+        LOGOUT("    Version number : 0x%02X\n", res->ID.Version);
+        LOGOUT("    Card ID        : 0x%012llX (%s)\n", ld_be48(res->ID.CardID), Utils::cardID_to_string(ld_be48(res->ID.CardID)));
+        LOGOUT("    Check digit    : 0x%04X (%u)\n", ld_be16(res->ID.CheckDigit), ld_be16(res->ID.CheckDigit));
         if (res->CardID_count > 1) {
             p = (RES_ID *)&res->SW1;
-            Log::logout("\n");
+            LOGOUT("\n");
             for (int i = 0;i < res->CardID_count - 1;i++) {
-                Log::logout("    Group ID type [%c]\n", Utils::cardID_to_string(ld_be48(p->CardID))[0]);
-                Log::logout("        Maker ID             : %c (0x%02X)\n", p->Maker, p->Maker);
-                Log::logout("        Version number       : 0x%02X\n", p->Version);
-                Log::logout("        Group ID             : 0x%012llX (%s)\n", ld_be48(p->CardID), Utils::cardID_to_string(ld_be48(p->CardID)));
-                Log::logout("        Group ID check digit : 0x%04X (%u)\n", ld_be16(p->CheckDigit), ld_be16(p->CheckDigit));
-                if (i != (res->CardID_count - 2)) Log::logout("\n");
+                LOGOUT("    Group ID type [%c]\n", Utils::cardID_to_string(ld_be48(p->CardID))[0]);
+                LOGOUT("        Maker ID             : %c (0x%02X)\n", p->Maker, p->Maker);
+                LOGOUT("        Version number       : 0x%02X\n", p->Version);
+                LOGOUT("        Group ID             : 0x%012llX (%s)\n", ld_be48(p->CardID), Utils::cardID_to_string(ld_be48(p->CardID)));
+                LOGOUT("        Group ID check digit : 0x%04X (%u)\n", ld_be16(p->CheckDigit), ld_be16(p->CheckDigit));
+                if (i != (res->CardID_count - 2)) LOGOUT("\n");
                 p++;
             }
         }
-        Log::logout("    Return code    : 0x%04X\n", returnCode);
+        LOGOUT("    Return code    : 0x%04X\n", returnCode);
 
-        return resCopy(pbRecvBuffer, pcbRecvLength, recvTemp, resSize);
+        return resReturn(pbRecvBuffer, pcbRecvLength, res, resSize);
     }
 
     //
@@ -463,9 +585,10 @@ namespace Cas {
         uint16_t returnCode = 0xA1FE;
         uint16_t swCode = 0x9000;
         CMD *cmd = (CMD *)pbSendBuffer;
+        uint8_t tmp[300];  // Decrypted command (cmd points here after the decryption, the response takes the keys from it)
 
-        uint8_t recvTemp[300] = { 0 };
-        RES *res = (RES *)recvTemp;
+        uint8_t recvTemp[sizeof(RES)];
+        RES *res = (RES *)resArea(pbRecvBuffer, pcbRecvLength, pbSendBuffer, cbSendLength, recvTemp, sizeof(recvTemp));
         DWORD resSize = sizeof(RES);
 
         uint8_t bgID = 0xff;
@@ -473,27 +596,30 @@ namespace Cas {
 
         TIER_t *pT = pTIER(BGID_TEMP);
 
-        Log::logout("[ECM command received]\n");
+        uint8_t cacheBGID = 0xff;  // Broadcast group ID of the ECM if its response can be cached
+        uint64_t generation = imageGeneration;
+
+        LOGOUT("[ECM command received]\n");
 
         {
             if ((cbSendLength < sizeof(CMD)) || (cmd->Lc != (cbSendLength - 6)) || (cmd->Lc > ECM_DATA_MAX_LENGTH)) {
-                Log::logout("    Command length abnormal\n");
+                LOGOUT("    Command length abnormal\n");
                 return resError(pbRecvBuffer, pcbRecvLength, 0x6700);
             }
 
             if (cmd->P1 || cmd->P2) {
-                Log::logout("    P1 / P2 abnormal: [ P1:0x%02X / P2: 0x%02X ]\n", cmd->P1, cmd->P2);
+                LOGOUT("    P1 / P2 abnormal: [ P1:0x%02X / P2: 0x%02X ]\n", cmd->P1, cmd->P2);
                 return resError(pbRecvBuffer, pcbRecvLength, 0x6A86);
             }
 
             uint8_t Le = *(pbSendBuffer + cbSendLength - 1);
             if (Le) {
-                Log::logout("    Le abnormal: 0x%02X\n", Le);
+                LOGOUT("    Le abnormal: 0x%02X\n", Le);
                 return resError(pbRecvBuffer, pcbRecvLength, 0x6700);
             }
 
             if (cmd->Lc < 0x1e) {  // Insufficient command data
-                Log::logout("    Insufficient command data  Lc: 0x%02X(%u)\n", cmd->Lc, cmd->Lc);
+                LOGOUT("    Insufficient command data  Lc: 0x%02X(%u)\n", cmd->Lc, cmd->Lc);
                 returnCode = 0x0A106;  // follow as the actual card
                 bgID = 0xff;
                 goto EXIT_FUNCTION;
@@ -501,13 +627,23 @@ namespace Cas {
 
             bgID = cmd->FixedPart.BroadcastGroupID;
 
+            // The same ECM is repeated until the scrambling key changes, so reuse the previous result if nothing has changed
+            if (bgID < BGID_COUNT) {
+                LONG result;
+                if (replayEcmCache(bgID, pbSendBuffer, cbSendLength, pbRecvBuffer, pcbRecvLength, &result)) {
+                    LOGOUT("    Same ECM as the previous one : Cached response returned\n");
+                    return result;
+                }
+                cacheBGID = bgID;
+            }
+
             bool invalidProtocolNumber = ((cmd->FixedPart.ProtocolNumber != 0x00) && (cmd->FixedPart.ProtocolNumber != 0x04) &&
                                             (cmd->FixedPart.ProtocolNumber != 0x40) && (cmd->FixedPart.ProtocolNumber != 0x44));
             bool invalidBroadcastGroupID = (bgID >= BGID_COUNT);
 
-            Log::logout("    Protocol number              : 0x%02X%s\n", cmd->FixedPart.ProtocolNumber, invalidProtocolNumber?" * Non-operational protocol number":"");
-            Log::logout("    Broadcast group ID           : 0x%02X (%s)\n", bgID, invalidBroadcastGroupID?" * Invalid Broadcast group ID":Utils::BroadcastGroupID_to_name(bgID));
-            Log::logout("    Work key ID                  : 0x%02X\n", cmd->FixedPart.WorkKeyID);
+            LOGOUT("    Protocol number              : 0x%02X%s\n", cmd->FixedPart.ProtocolNumber, invalidProtocolNumber?" * Non-operational protocol number":"");
+            LOGOUT("    Broadcast group ID           : 0x%02X (%s)\n", bgID, invalidBroadcastGroupID?" * Invalid Broadcast group ID":Utils::BroadcastGroupID_to_name(bgID));
+            LOGOUT("    Work key ID                  : 0x%02X\n", cmd->FixedPart.WorkKeyID);
 
             if (invalidProtocolNumber) {
                 returnCode = 0xA102;  // Non-operational protocol number error
@@ -525,7 +661,7 @@ namespace Cas {
             memcpy(pT, pTIER(bgID), sizeof(TIER_t));
 
             if (!pT->ActivationState) {
-                Log::logout("    * No broadcast information\n");
+                LOGOUT("    * No broadcast information\n");
                 returnCode = 0xA103;
                 bgID = 0xff;
                 goto EXIT_FUNCTION;
@@ -533,48 +669,48 @@ namespace Cas {
 
             uint64_t key = getWorkKey(bgID, cmd->FixedPart.WorkKeyID);
             if (!key) {
-                Log::logout("    * No work key\n");
+                LOGOUT("    * No work key\n");
                 returnCode = 0xA103;
                 bgID = 0xff;
                 goto EXIT_FUNCTION;
             }
 
             // Message decryption
-            uint8_t tmp[300];
-            memcpy(tmp, cmd, cbSendLength);
-
+            // Only the clear part is copied to the plaintext view, the encrypted part is decrypted straight into it
             uint32_t decodingStartPoint = offsetof(CMD, FixedPart.OddKey);
+            memcpy(tmp, cmd, decodingStartPoint);
+            tmp[ cbSendLength - 1 ] = pbSendBuffer[ cbSendLength - 1 ];  // Le
             uint32_t decodingLength = (cbSendLength - decodingStartPoint - 1);
             const uint8_t *in = (const uint8_t *)cmd + decodingStartPoint;
             uint8_t *out = &tmp[ decodingStartPoint ];
-            Crypto::decrypt(out, in, decodingLength, key, cmd->FixedPart.ProtocolNumber);
+            // The falsification check starts at the protocol number, in front of the encrypted part
+            uint32_t checkingStartPoint = offsetof(CMD, FixedPart.ProtocolNumber);
+            uint32_t calcValue = 0;
+            bool verified = Crypto::decrypt_and_verify(out, in, decodingLength, getKeyContext(key, cmd->FixedPart.ProtocolNumber),
+                                                        &tmp[ checkingStartPoint ], decodingStartPoint - checkingStartPoint, &calcValue);
             cmd = (CMD *)tmp;
 
-            Log::logout("    Decryption key               : 0x%016llX\n", key);
-            Log::logout("    Decrypted data               : [ ");
+            LOGOUT("    Decryption key               : 0x%016llX\n", key);
+            LOGOUT("    Decrypted data               : [ ");
             Log::logout_dump(out, decodingLength, 0);
-            Log::logout(" ]\n");
+            LOGOUT(" ]\n");
 
             // Falsification check
-            uint16_t checkingStartPoint = offsetof(CMD, FixedPart.ProtocolNumber);
-            uint16_t checkingLength = (uint16_t)(cbSendLength - checkingStartPoint - 5);
-            in = &tmp[ checkingStartPoint ];
-            uint32_t calcValue = Crypto::digest(cmd->FixedPart.ProtocolNumber, key, in, checkingLength);
             uint32_t macValue = ld_be32(out + decodingLength - 4);
-            if (macValue != calcValue) {
-                Log::logout("    ECM falsification error      : Calculated value (0x%08lX) ≠ Falsification detection (0x%08lX)\n", calcValue, macValue);
+            if (!verified) {
+                LOGOUT("    ECM falsification error      : Calculated value (0x%08lX) ≠ Falsification detection (0x%08lX)\n", calcValue, macValue);
                 returnCode = 0x0A106;  // ECM falsification error
                 bgID = 0xff;
                 goto EXIT_FUNCTION;
             }
 
-            Log::logout("    Falsification detection code : 0x%08lX\n", macValue);
-            Log::logout("    Odd scrambled key            : 0x%016llX\n", ld_be64(cmd->FixedPart.OddKey));
-            Log::logout("    Even scrambled key           : 0x%016llX\n", ld_be64(cmd->FixedPart.EvenKey));
-            Log::logout("    Judgment type                : 0x%02X\n", cmd->FixedPart.ProgramType);
-            Log::logout("    Date                         : %s\n", Utils::mjd_to_string(ld_be16(cmd->FixedPart.Date)));
-            Log::logout("    Time                         : %s\n", Utils::time_to_string(cmd->FixedPart.Time));
-            Log::logout("    Recording control            : 0x%02X\n", cmd->FixedPart.RecordingControl);
+            LOGOUT("    Falsification detection code : 0x%08lX\n", macValue);
+            LOGOUT("    Odd scrambled key            : 0x%016llX\n", ld_be64(cmd->FixedPart.OddKey));
+            LOGOUT("    Even scrambled key           : 0x%016llX\n", ld_be64(cmd->FixedPart.EvenKey));
+            LOGOUT("    Judgment type                : 0x%02X\n", cmd->FixedPart.ProgramType);
+            LOGOUT("    Date                         : %s\n", Utils::mjd_to_string(ld_be16(cmd->FixedPart.Date)));
+            LOGOUT("    Time                         : %s\n", Utils::time_to_string(cmd->FixedPart.Time));
+            LOGOUT("    Recording control            : 0x%02X\n", cmd->FixedPart.RecordingControl);
 
             // Variable length data part processing
             uint8_t *p = &tmp[ offsetof(CMD,Le) ];
@@ -582,7 +718,7 @@ namespace Cas {
 
             returnCode = (cmd->FixedPart.ProgramType == 4) ? 0xA102 : ((cmd->FixedPart.ProgramType & 0x01) ? 0x0800 : 0xA1FE); // Match the actual card
             while (remain > 0) {
-                Log::logout("\n        Function number : 0x%02X ", *p);
+                LOGOUT("\n        Function number : 0x%02X ", *p);
                 switch (*p) {
                     case 0x21:  // Multi function
                         processNano21(pT, pMESSAGE(bgID), p, INS_ECM, true);
@@ -599,25 +735,25 @@ namespace Cas {
                     case 0x52:  // CheckContract bitmap
                         Contracted = processNano52(pT, p);
                         if (cmd->FixedPart.ProgramType == 0x02) {
-                            Log::logout("            Contract status          : ");
+                            LOGOUT("            Contract status          : ");
                             if (!checkExpiryDate(pT, ld_be16(cmd->FixedPart.Date), cmd->FixedPart.Time[0]) && (pT->ActivationState != 2)) {
-                                Log::logout("Expired (%s %02u)\n", Utils::mjd_to_string(ld_be16(pT->ExpiryDate)), cmd->FixedPart.Time[0]);
+                                LOGOUT("Expired (%s %02u)\n", Utils::mjd_to_string(ld_be16(pT->ExpiryDate)), cmd->FixedPart.Time[0]);
                                 returnCode = 0x8902;
                             } else if (Contracted) {
-                                Log::logout("Purchased\n");
+                                LOGOUT("Purchased\n");
                                 returnCode = 0x0800;
                             } else {
-                                Log::logout("No contract\n");
+                                LOGOUT("No contract\n");
                                 returnCode = 0x8901;
                             }
                         } else {
-                            Log::logout("            * The contract confirmation result is invalid because the judgment type is not 0x02\n");
+                            LOGOUT("            * The contract confirmation result is invalid because the judgment type is not 0x02\n");
                         }
                         break;
 
                     default:
-                        Log::logout("<Unknown/unsupported functions>\n");
-                        Log::logout("\n");
+                        LOGOUT("<Unknown/unsupported functions>\n");
+                        LOGOUT("\n");
                         break;
                 }
 
@@ -626,7 +762,7 @@ namespace Cas {
             }
 
             if (remain != 0) {  // Variable length parameter length error?
-                Log::logout("    * Detect errors in variable length data\n");
+                LOGOUT("    * Detect errors in variable length data\n");
                 returnCode = 0x0A106;  // ECM falsification error (follow as the actual card)
                 bgID = 0xff;
                 goto EXIT_FUNCTION;
@@ -634,13 +770,14 @@ namespace Cas {
         }
 
     EXIT_FUNCTION:
-        Log::logout("\n    Return code                  : 0x%04X\n", returnCode);
+        LOGOUT("\n    Return code                  : 0x%04X\n", returnCode);
 
         // If it ends normally, copy the information from the temporary area to the corresponding tier
         if (bgID < BGID_COUNT) {
             pT->checkDigit = Utils::calc_tier_check_digit(pT);
-            pMESSAGE(bgID)->checkDigit = Utils::calc_message_check_digit(pMESSAGE(bgID));
-            memcpy(pTIER(bgID), pT, sizeof(TIER_t));
+            uint8_t messageCheckDigit = Utils::calc_message_check_digit(pMESSAGE(bgID));
+            writeCardImage(&pMESSAGE(bgID)->checkDigit, &messageCheckDigit, 1);
+            writeCardImage(pTIER(bgID), pT, sizeof(TIER_t));
         }
 
         res->ProtocolNumber = 0;
@@ -654,7 +791,12 @@ namespace Cas {
         }
         st_be16(&res->SW1, swCode);
 
-        return resCopy(pbRecvBuffer, pcbRecvLength, recvTemp, resSize);
+        // Only a response that left the card image untouched can be replayed
+        if ((cacheBGID < BGID_COUNT) && (generation == imageGeneration)) {
+            storeEcmCache(cacheBGID, generation, pbSendBuffer, cbSendLength, (const uint8_t *)res, resSize);
+        }
+
+        return resReturn(pbRecvBuffer, pcbRecvLength, res, resSize);
     }
 
     //
@@ -693,30 +835,30 @@ namespace Cas {
         uint16_t swCode = 0x9000;
         CMD *cmd = (CMD *)pbSendBuffer;
 
-        uint8_t recvTemp[300] = { 0 };
-        RES *res = (RES *)recvTemp;
+        uint8_t recvTemp[sizeof(RES)];
+        RES *res = (RES *)resArea(pbRecvBuffer, pcbRecvLength, pbSendBuffer, cbSendLength, recvTemp, sizeof(recvTemp));
         DWORD resSize = sizeof(RES);
 
         uint8_t bgID = 0xff;
 
         TIER_t *pT = pTIER(BGID_TEMP);
 
-        Log::logout("[EMM command received]\n");
+        LOGOUT("[EMM command received]\n");
 
         {
             if ((cbSendLength < sizeof(CMD)) || (cmd->Lc != (cbSendLength - 6)) || (cmd->Lc > EMM_DATA_MAX_LENGTH)) {
-                Log::logout("    Command length abnormal\n");
+                LOGOUT("    Command length abnormal\n");
                 return resError(pbRecvBuffer, pcbRecvLength, 0x6700);
             }
 
             if (cmd->P1 || cmd->P2) {
-                Log::logout("    P1 / P2 abnormal: [ P1:0x%02X / P2: 0x%02X ]\n", cmd->P1, cmd->P2);
+                LOGOUT("    P1 / P2 abnormal: [ P1:0x%02X / P2: 0x%02X ]\n", cmd->P1, cmd->P2);
                 return resError(pbRecvBuffer, pcbRecvLength, 0x6A86);
             }
 
             uint8_t Le = *(pbSendBuffer + cbSendLength - 1);
             if (Le) {
-                Log::logout("    Le abnormal: 0x%02X\n", Le);
+                LOGOUT("    Le abnormal: 0x%02X\n", Le);
                 return resError(pbRecvBuffer, pcbRecvLength, 0x6700);
             }
 
@@ -728,15 +870,15 @@ namespace Cas {
                                             (cmd->FixedPart.ProtocolNumber != 0x40) && (cmd->FixedPart.ProtocolNumber != 0x44));
             bool invalidCardID = (grpID < 0);
 
-            Log::logout("    Data length                     : 0x%02X (%u)\n", cmd->FixedPart.Length, cmd->FixedPart.Length);
+            LOGOUT("    Data length                     : 0x%02X (%u)\n", cmd->FixedPart.Length, cmd->FixedPart.Length);
 
-            Log::logout("    Destination card ID             : 0x%012llX (%s)\n", CardID, Utils::cardID_to_string(CardID));
+            LOGOUT("    Destination card ID             : 0x%012llX (%s)\n", CardID, Utils::cardID_to_string(CardID));
             if (invalidCardID) {
-                Log::logout("                                      * Not an EMM addressed to this card [Main card ID: 0x%012llX %s]\n", CardID, Utils::cardID_to_string(CardID));
+                LOGOUT("                                      * Not an EMM addressed to this card [Main card ID: 0x%012llX %s]\n", CardID, Utils::cardID_to_string(CardID));
             } else if (grpID > 0) {
-                Log::logout("                                      * EMM addressed to group ID\n");
+                LOGOUT("                                      * EMM addressed to group ID\n");
             }
-            Log::logout("    Protocol number                 : 0x%02X%s\n", cmd->FixedPart.ProtocolNumber, invalidProtocolNumber?" * Non-operational protocol number":"");
+            LOGOUT("    Protocol number                 : 0x%02X%s\n", cmd->FixedPart.ProtocolNumber, invalidProtocolNumber?" * Non-operational protocol number":"");
 
             if (invalidProtocolNumber) {
                 returnCode = 0xA102;  // Non-operational protocol number error
@@ -751,29 +893,30 @@ namespace Cas {
             }
 
             // Message decryption
+            // Only the clear part is copied to the plaintext view, the encrypted part is decrypted straight into it
             uint8_t tmp[300];
-            memcpy(tmp, cmd, cbSendLength);
-
             uint32_t decodingStartPoint = offsetof(CMD, FixedPart.BroadcastGroupID);
+            memcpy(tmp, cmd, decodingStartPoint);
+            tmp[ cbSendLength - 1 ] = pbSendBuffer[ cbSendLength - 1 ];  // Le
             uint32_t decodingLength = (cbSendLength - decodingStartPoint - 1);
             const uint8_t *in = (const uint8_t *)cmd + decodingStartPoint;
             uint8_t *out = &tmp[ decodingStartPoint ];
-            Crypto::decrypt(out, in, decodingLength, ld_be64(pID->Km), cmd->FixedPart.ProtocolNumber);
+            // The falsification check starts at the card ID, in front of the encrypted part
+            uint32_t checkingStartPoint = offsetof(CMD, FixedPart.CardID);
+            uint32_t calcValue = 0;
+            bool verified = Crypto::decrypt_and_verify(out, in, decodingLength, getKeyContext(ld_be64(pID->Km), cmd->FixedPart.ProtocolNumber),
+                                                        &tmp[ checkingStartPoint ], decodingStartPoint - checkingStartPoint, &calcValue);
             cmd = (CMD *)tmp;
 
-            Log::logout("    Decryption key                  : 0x%016llX\n", ld_be64(pID->Km));
-            Log::logout("    Decrypted data                  : [ ");
+            LOGOUT("    Decryption key                  : 0x%016llX\n", ld_be64(pID->Km));
+            LOGOUT("    Decrypted data                  : [ ");
             Log::logout_dump(out, decodingLength, 0);
-            Log::logout(" ]\n");
+            LOGOUT(" ]\n");
 
             // Falsification check
-            uint16_t checkingStartPoint = offsetof(CMD, FixedPart.CardID);
-            uint16_t checkingLength = (uint16_t)(cbSendLength - checkingStartPoint - 5);
-            in = &tmp[ checkingStartPoint ];
-            uint32_t calcValue = Crypto::digest(cmd->FixedPart.ProtocolNumber, ld_be64(pID->Km), in, checkingLength);
             uint32_t macValue = ld_be32(out + decodingLength - 4);
-            if (macValue != calcValue) {
-                Log::logout("    EMM falsification error         : Calculated value (0x%08lX) ≠ Falsification detection (0x%08lX)\n", calcValue, macValue);
+            if (!verified) {
+                LOGOUT("    EMM falsification error         : Calculated value (0x%08lX) ≠ Falsification detection (0x%08lX)\n", calcValue, macValue);
                 returnCode = 0x0A107;  // EMM falsification error
                 bgID = 0xff;
                 goto EXIT_FUNCTION;
@@ -782,10 +925,10 @@ namespace Cas {
             bgID = cmd->FixedPart.BroadcastGroupID;
             bool invalidBroadcastGroupID = (bgID >= BGID_COUNT);
 
-            Log::logout("    Falsification detection code    : 0x%08lX\n", macValue);
-            Log::logout("    Broadcast group ID              : 0x%02X (%s)\n", bgID, invalidBroadcastGroupID?" * Invalid Broadcast group ID":Utils::BroadcastGroupID_to_name(bgID));
-            Log::logout("    Update number                   : 0x%04X (%u)\n", ld_be16(cmd->FixedPart.UpdateNumber), ld_be16(cmd->FixedPart.UpdateNumber));
-            Log::logout("    Expiry date                     : %s\n", Utils::mjd_to_string(ld_be16(cmd->FixedPart.ExpiryDate)));
+            LOGOUT("    Falsification detection code    : 0x%08lX\n", macValue);
+            LOGOUT("    Broadcast group ID              : 0x%02X (%s)\n", bgID, invalidBroadcastGroupID?" * Invalid Broadcast group ID":Utils::BroadcastGroupID_to_name(bgID));
+            LOGOUT("    Update number                   : 0x%04X (%u)\n", ld_be16(cmd->FixedPart.UpdateNumber), ld_be16(cmd->FixedPart.UpdateNumber));
+            LOGOUT("    Expiry date                     : %s\n", Utils::mjd_to_string(ld_be16(cmd->FixedPart.ExpiryDate)));
 
             if (invalidBroadcastGroupID) {
                 returnCode = 0xA1FE;  // Other error
@@ -804,12 +947,12 @@ namespace Cas {
             if (updateEnable) {
 
                 if (updateNumber != 0xc000) {
-                    Log::logout("    Execute update number change    : 0x%04X -> 0x%04X\n", currentUpdateNumber, updateNumber);
+                    LOGOUT("    Execute update number change    : 0x%04X -> 0x%04X\n", currentUpdateNumber, updateNumber);
                     st_be16(pT->UpdateNumber1, updateNumber);  // Update number change
                 }
 
                 if (pT->ActivationState != 2) {
-                    Log::logout("    Execute activation state change : 0x%02X -> 0x%02X\n", pT->ActivationState, 0x02);
+                    LOGOUT("    Execute activation state change : 0x%02X -> 0x%02X\n", pT->ActivationState, 0x02);
                     pT->ActivationState = 2;  // Active state
                 }
 
@@ -818,22 +961,22 @@ namespace Cas {
                 st_be16(pT->ExpiryDate, ExpiryDate);
                 if (ExpiryDate) pT->ExpiryHour = 0x23;
                 if (currentExpiryDate != ExpiryDate) {
-                    Log::logout("    Execute expiry date update      : ");
-                    Log::logout("%s", Utils::mjd_to_string(currentExpiryDate));
-                    Log::logout(" -> ");
-                    Log::logout("%s (ExpiryHour: 0x%02X)", Utils::mjd_to_string(ExpiryDate), pT->ExpiryHour);
-                    Log::logout("\n");
+                    LOGOUT("    Execute expiry date update      : ");
+                    LOGOUT("%s", Utils::mjd_to_string(currentExpiryDate));
+                    LOGOUT(" -> ");
+                    LOGOUT("%s (ExpiryHour: 0x%02X)", Utils::mjd_to_string(ExpiryDate), pT->ExpiryHour);
+                    LOGOUT("\n");
                 }
 
             } else {
-                Log::logout("    * Invalid update number (Current update number 0x%04X) \n", currentUpdateNumber);
+                LOGOUT("    * Invalid update number (Current update number 0x%04X) \n", currentUpdateNumber);
             }
 
             // Variable length data part processing
             uint8_t *p = &tmp[ offsetof(CMD,Le) ];
             long remain = cmd->FixedPart.Length - 10;
             while (remain > 0) {
-                Log::logout("\n        Function number : 0x%02X ", *p);
+                LOGOUT("\n        Function number : 0x%02X ", *p);
                 switch (*p) {
                     case 0x10:  // Update tier key
                         processNano10(pT, bgID, p, updateEnable);
@@ -860,8 +1003,8 @@ namespace Cas {
                         break;
 
                     default:
-                        Log::logout("<Unsupported functions>\n");
-                        Log::logout("\n");
+                        LOGOUT("<Unsupported functions>\n");
+                        LOGOUT("\n");
                         break;
                 }
 
@@ -870,7 +1013,7 @@ namespace Cas {
             }
 
             if (remain != 0) {  // Variable length parameter length error?
-                Log::logout("    * Detect errors in variable length data\n");
+                LOGOUT("    * Detect errors in variable length data\n");
                 returnCode = 0x0A107;  // EMM falsification error (follow as the actual card)
                 bgID = 0xff;
                 goto EXIT_FUNCTION;
@@ -878,13 +1021,14 @@ namespace Cas {
         }
 
     EXIT_FUNCTION:
-        Log::logout("    Return code                     : 0x%04X\n", returnCode);
+        LOGOUT("    Return code                     : 0x%04X\n", returnCode);
 
         // If it ends normally, copy the information from the temporary area to the corresponding tier
         if (bgID < BGID_COUNT) {
             pT->checkDigit = Utils::calc_tier_check_digit(pT);
-            pMESSAGE(bgID)->checkDigit = Utils::calc_message_check_digit(pMESSAGE(bgID));
-            memcpy(pTIER(bgID), pT, sizeof(TIER_t));
+            uint8_t messageCheckDigit = Utils::calc_message_check_digit(pMESSAGE(bgID));
+            writeCardImage(&pMESSAGE(bgID)->checkDigit, &messageCheckDigit, 1);
+            writeCardImage(pTIER(bgID), pT, sizeof(TIER_t));
         }
 
         res->ProtocolNumber = 0;  // 0 fixed
@@ -893,7 +1037,7 @@ namespace Cas {
         st_be16(&res->ReturnCode, returnCode);
         st_be16(&res->SW1, swCode);
 
-        return resCopy(pbRecvBuffer, pcbRecvLength, recvTemp, resSize);
+        return resReturn(pbRecvBuffer, pcbRecvLength, res, resSize);
     }
 
     //
@@ -942,11 +1086,11 @@ namespace Cas {
         uint16_t swCode = 0x9000;
 
         uint8_t sendTemp[300] = { 0 };
-        uint8_t recvTemp[300] = { 0 };
+        uint8_t recvTemp[sizeof(RES) + EMG_DATA_MAX_LENGTH];  // The unknown control process returns the redundant data length as well
         uint16_t sendLen = ((uint16_t)cbSendLength > sizeof(sendTemp)) ? sizeof(sendTemp) : ((uint16_t)cbSendLength);
         memcpy(sendTemp, pbSendBuffer, sendLen);
         CMD *cmd = (CMD *)sendTemp;
-        RES *res = (RES *)recvTemp;
+        RES *res = (RES *)resArea(pbRecvBuffer, pcbRecvLength, pbSendBuffer, cbSendLength, recvTemp, sizeof(recvTemp));
         DWORD resSize = sizeof(RES);
 
         uint8_t bgID = 0xff;
@@ -955,22 +1099,22 @@ namespace Cas {
         uint16_t len;
         int msgLen;
 
-        Log::logout("[EMG command received]\n");
+        LOGOUT("[EMG command received]\n");
 
         {
             if ((sendLen < 15) || (cmd->Lc != (sendLen - 6)) || (cmd->Lc > EMG_DATA_MAX_LENGTH)) {
-                Log::logout("    Command length abnormal\n");
+                LOGOUT("    Command length abnormal\n");
                 return resError(pbRecvBuffer, pcbRecvLength, 0x6700);
             }
 
             if (cmd->P1 || cmd->P2) {
-                Log::logout("    P1 / P2 abnormal: [ P1:0x%02X / P2: 0x%02X ]\n", cmd->P1, cmd->P2);
+                LOGOUT("    P1 / P2 abnormal: [ P1:0x%02X / P2: 0x%02X ]\n", cmd->P1, cmd->P2);
                 return resError(pbRecvBuffer, pcbRecvLength, 0x6A86);
             }
 
             uint8_t Le = sendTemp[ sendLen - 1 ];
             if (Le) {
-                Log::logout("    Le abnormal: 0x%02X\n", Le);
+                LOGOUT("    Le abnormal: 0x%02X\n", Le);
                 return resError(pbRecvBuffer, pcbRecvLength, 0x6700);
             }
 
@@ -1002,15 +1146,15 @@ namespace Cas {
                 }
             }
 
-            Log::logout("    Destination card ID                 : 0x%012llX (%s)\n", CardID, Utils::cardID_to_string(CardID));
+            LOGOUT("    Destination card ID                 : 0x%012llX (%s)\n", CardID, Utils::cardID_to_string(CardID));
             if (invalidCardID) {
-                Log::logout("                                          * Not an EMG addressed to this card [Main card ID: 0x%012llX %s]\n", CardID, Utils::cardID_to_string(CardID));
+                LOGOUT("                                          * Not an EMG addressed to this card [Main card ID: 0x%012llX %s]\n", CardID, Utils::cardID_to_string(CardID));
             } else if (grpID > 0) {
-                Log::logout("                                          * EMG addressed to group ID\n");
+                LOGOUT("                                          * EMG addressed to group ID\n");
             }
-            Log::logout("    Protocol number                     : 0x%02X%s\n", cmd->FixedPart.ProtocolNumber, invalidProtocolNumber?" * Non-operational protocol number":"");
-            Log::logout("    Broadcast group ID                  : 0x%02X (%s)\n", bgID, invalidBroadcastGroupID?" * Invalid Broadcast group ID":Utils::BroadcastGroupID_to_name(bgID));
-            Log::logout("    Message control                     : 0x%02X%s\n", cmd->FixedPart.MessageControl, invalidMessageControl?" * Invalid message control":"");
+            LOGOUT("    Protocol number                     : 0x%02X%s\n", cmd->FixedPart.ProtocolNumber, invalidProtocolNumber?" * Non-operational protocol number":"");
+            LOGOUT("    Broadcast group ID                  : 0x%02X (%s)\n", bgID, invalidBroadcastGroupID?" * Invalid Broadcast group ID":Utils::BroadcastGroupID_to_name(bgID));
+            LOGOUT("    Message control                     : 0x%02X%s\n", cmd->FixedPart.MessageControl, invalidMessageControl?" * Invalid message control":"");
 
             if (invalidCardID) {
                 returnCode = 0xA1FE;  // Other error
@@ -1041,7 +1185,7 @@ namespace Cas {
                 DWORD dataLen = cbSendLength - 15;
 
                 if (dataLen) {
-                    Log::logout("    * Redundant parameter  %3d bytes: ", dataLen);
+                    LOGOUT("    * Redundant parameter  %3d bytes: ", dataLen);
                     Log::logout_dump(pbSendBuffer + 14, (uint16_t) dataLen, 2);
                 }
 
@@ -1059,8 +1203,8 @@ namespace Cas {
                     st_be16(&res->ReturnCode, 0xa1fe);  // Other error
                 }
                 st_be16(p, swCode);
-                Log::logout("    * Unknown control process\n");
-                return resCopy(pbRecvBuffer, pcbRecvLength, recvTemp, resSize);
+                LOGOUT("    * Unknown control process\n");
+                return resReturn(pbRecvBuffer, pcbRecvLength, res, resSize);
             }
 
             // Copy the relevant message control information to the temporary area and rewrite the data there
@@ -1071,38 +1215,35 @@ namespace Cas {
             uint16_t decodingStartPoint = offsetof(CMD, FixedPart.AlternationDetector);
             uint16_t decodingLength = (uint16_t)(sendLen - decodingStartPoint - 1);
             uint8_t *in = &sendTemp[ decodingStartPoint ];
-            Crypto::decrypt(tmp, in, decodingLength, ld_be64(pID->Km), cmd->FixedPart.ProtocolNumber);
+
+            // The falsification check starts at the encrypted part (Ver2) or at the card ID in front of it (Ver3~)
+            uint16_t checkingStartPoint = (sys.cardVersion < 3) ? decodingStartPoint : offsetof(CMD, FixedPart.CardID);
+            uint32_t calcValue = 0;
+            bool verified = Crypto::decrypt_and_verify(tmp, in, decodingLength, getKeyContext(ld_be64(pID->Km), cmd->FixedPart.ProtocolNumber),
+                                                        &sendTemp[ checkingStartPoint ], decodingStartPoint - checkingStartPoint, &calcValue);
             memcpy(in, tmp, decodingLength - 4);
             memset(&in[decodingLength - 4], 0x00, 4);
             uint32_t macValue = ld_be32(&tmp[ decodingLength - 4 ]);
 
-            Log::logout("    Decryption key                      : 0x%016llX\n", ld_be64(pID->Km));
-            Log::logout("    Decrypted data                      : [ ");
+            LOGOUT("    Decryption key                      : 0x%016llX\n", ld_be64(pID->Km));
+            LOGOUT("    Decrypted data                      : [ ");
             Log::logout_dump(tmp, decodingLength, 0);
-            Log::logout(" ]\n");
-            Log::logout("    Falsification detection code (T%03u) : 0x%08lX\n", sys.cardVersion, macValue);
+            LOGOUT(" ]\n");
+            LOGOUT("    Falsification detection code (T%03u) : 0x%08lX\n", sys.cardVersion, macValue);
 
             // Falsification check
-            uint32_t calcValue = 0;
-
-            if (sys.cardVersion < 3) {
-                calcValue = Crypto::digest(cmd->FixedPart.ProtocolNumber, ld_be64(pID->Km), &cmd->FixedPart.AlternationDetector[0], decodingLength - 4);
-            } else {
-                calcValue = Crypto::digest(cmd->FixedPart.ProtocolNumber, ld_be64(pID->Km), &cmd->FixedPart.CardID[0], decodingLength + 5);
-            }
-
-            if (macValue != calcValue) {
-                Log::logout("    EMG falsification error             : Calculated value (0x%08lX) ≠ Falsification detection (0x%08lX)\n", calcValue, macValue);
+            if (!verified) {
+                LOGOUT("    EMG falsification error             : Calculated value (0x%08lX) ≠ Falsification detection (0x%08lX)\n", calcValue, macValue);
                 returnCode = 0x0A105;  // EMG falsification error
                 bgID = 0xff;
                 goto EXIT_FUNCTION;
             }
 
-            Log::logout("    Update number                       : 0x%04X\n", ld_be16(cmd->FixedPart.AlternationDetector));
-            Log::logout("    Expiry date                         : %s\n", Utils::mjd_to_string(ld_be16(cmd->FixedPart.LimitDate)));
-            Log::logout("    Message template number             : 0x%04X\n", ld_be16(cmd->FixedPart.FixedMessageID));
-            Log::logout("    Differential format number          : 0x%02X\n", cmd->FixedPart.ExtraMessageFormatVersion);
-            Log::logout("    Difference information length       : 0x%04X (%u)\n", ld_be16(cmd->FixedPart.ExtraMessageLength), ld_be16(cmd->FixedPart.ExtraMessageLength));
+            LOGOUT("    Update number                       : 0x%04X\n", ld_be16(cmd->FixedPart.AlternationDetector));
+            LOGOUT("    Expiry date                         : %s\n", Utils::mjd_to_string(ld_be16(cmd->FixedPart.LimitDate)));
+            LOGOUT("    Message template number             : 0x%04X\n", ld_be16(cmd->FixedPart.FixedMessageID));
+            LOGOUT("    Differential format number          : 0x%02X\n", cmd->FixedPart.ExtraMessageFormatVersion);
+            LOGOUT("    Difference information length       : 0x%04X (%u)\n", ld_be16(cmd->FixedPart.ExtraMessageLength), ld_be16(cmd->FixedPart.ExtraMessageLength));
 
             len = ld_be16(cmd->FixedPart.ExtraMessageLength);
             if (len > 20) len = 20;
@@ -1110,22 +1251,22 @@ namespace Cas {
             if (msgLen < 0) msgLen = 0;
             if ((uint16_t)msgLen > len) msgLen = len;
             if (msgLen > 0) {
-                Log::logout("    Difference information        : ");
+                LOGOUT("    Difference information        : ");
                 Log::logout_dump(&cmd->Le, msgLen, 8);
             }
 
             long dlen = ((long)cbSendLength - offsetof(CMD, Le) - 5) - len;
             if (dlen > 0) {
-                Log::logout("    * Redundant difference information  %3d bytes: ", dlen);
+                LOGOUT("    * Redundant difference information  %3d bytes: ", dlen);
                 Log::logout_dump(&cmd->Le + len, (uint16_t)dlen, 0);
             } else if (dlen < 0) {
-                Log::logout("    * Insufficient difference information (compensated with 0x00): %d bytes\n", -dlen);
+                LOGOUT("    * Insufficient difference information (compensated with 0x00): %d bytes\n", -dlen);
             }
 
             // Update number check
             uint16_t updateNumber = ld_be16(cmd->FixedPart.AlternationDetector);
             if (updateNumber < 0xc000) {  // Error if less than 0xc000
-                Log::logout("    * Update number less than 0xC000\n");
+                LOGOUT("    * Update number less than 0xC000\n");
                 returnCode = 0x0A1FE;  // Other error
                 bgID = 0xff;
                 goto EXIT_FUNCTION;
@@ -1134,12 +1275,12 @@ namespace Cas {
                 uint16_t currentUpdateNumber = ld_be16(pMSG->UpdateNumber);
                 updateNumber &= 0x3fff;  // Effective bit length 14bit
                 if (updateNumber <= currentUpdateNumber) {  // Error if update number is invalid
-                    Log::logout("    * Invalid update number (Current update number 0x%04X) \n", currentUpdateNumber);
+                    LOGOUT("    * Invalid update number (Current update number 0x%04X) \n", currentUpdateNumber);
                     returnCode = 0x0A1FE;  // Other error
                     bgID = 0xff;
                     goto EXIT_FUNCTION;
                 }
-                Log::logout("    Execute update number change         : 0x%04X -> 0x%04X\n", currentUpdateNumber, updateNumber);
+                LOGOUT("    Execute update number change         : 0x%04X -> 0x%04X\n", currentUpdateNumber, updateNumber);
                 st_be16(pMSG->UpdateNumber, updateNumber);
             }
 
@@ -1167,12 +1308,12 @@ namespace Cas {
         }
 
     EXIT_FUNCTION:
-        Log::logout("    Return code                         : 0x%04X\n", returnCode);
+        LOGOUT("    Return code                         : 0x%04X\n", returnCode);
 
         // If it ends normally, copy the information from the temporary area to the corresponding message control area.
         if (bgID < BGID_COUNT) {
             pMSG->checkDigit = Utils::calc_message_check_digit(pMSG);
-            memcpy(pMESSAGE(bgID), pMSG, sizeof(MESSAGE_t));
+            writeCardImage(pMESSAGE(bgID), pMSG, sizeof(MESSAGE_t));
         }
 
         res->ProtocolNumber = 0;  // 0 fixed
@@ -1181,7 +1322,7 @@ namespace Cas {
 
         if (returnCode == 0x2100) {
             pMSG->checkDigit = Utils::calc_message_check_digit(pMSG);
-            memcpy(pMESSAGE(bgID), pMSG, sizeof(MESSAGE_t));
+            writeCardImage(pMESSAGE(bgID), pMSG, sizeof(MESSAGE_t));
 
             len = cmd->Lc - 22;
             if (len >= 20) len = 20;
@@ -1212,7 +1353,7 @@ namespace Cas {
             resSize = 8;
         }
 
-        return resCopy(pbRecvBuffer, pcbRecvLength, recvTemp, resSize);
+        return resReturn(pbRecvBuffer, pcbRecvLength, res, resSize);
     }
 
     //
@@ -1253,30 +1394,30 @@ namespace Cas {
 
         CMD *cmd = (CMD *)pbSendBuffer;
 
-        uint8_t recvTemp[300] = { 0 };
-        RES *res = (RES *)recvTemp;
+        uint8_t recvTemp[sizeof(RES) + sizeof(MESSAGE_t::diff_information)];
+        RES *res = (RES *)resArea(pbRecvBuffer, pcbRecvLength, pbSendBuffer, cbSendLength, recvTemp, sizeof(recvTemp));
         DWORD resSize = sizeof(RES);
 
         uint8_t bgID = 0xff;
 
         MESSAGE_t *pMSG = pMESSAGE(BGID_TEMP);
 
-        Log::logout("[EMD command received]\n");
+        LOGOUT("[EMD command received]\n");
 
         {
             if ((cbSendLength != sizeof(CMD)) || (cmd->Lc != (cbSendLength - 6)) || (cmd->Lc > EMD_DATA_MAX_LENGTH)) {
-                Log::logout("    Command length abnormal\n");
+                LOGOUT("    Command length abnormal\n");
                 return resError(pbRecvBuffer, pcbRecvLength, 0x6700);
             }
 
             if (cmd->P1 || cmd->P2) {
-                Log::logout("    P1 / P2 abnormal: [ P1:0x%02X / P2: 0x%02X ]\n", cmd->P1, cmd->P2);
+                LOGOUT("    P1 / P2 abnormal: [ P1:0x%02X / P2: 0x%02X ]\n", cmd->P1, cmd->P2);
                 return resError(pbRecvBuffer, pcbRecvLength, 0x6A86);
             }
 
             uint8_t Le = *(pbSendBuffer + cbSendLength - 1);
             if (Le) {
-                Log::logout("    Le abnormal: 0x%02X\n", Le);
+                LOGOUT("    Le abnormal: 0x%02X\n", Le);
                 return resError(pbRecvBuffer, pcbRecvLength, 0x6700);
             }
 
@@ -1286,9 +1427,9 @@ namespace Cas {
             bgID = cmd->FixedPart.BroadcastGroupID;
             bool invalidBroadcastGroupID = (bgID >= BGID_COUNT);
 
-            Log::logout("    Date               : %s\n", Utils::mjd_to_string(Date));
-            Log::logout("    Broadcast group ID : 0x%02X (%s)\n", bgID, invalidBroadcastGroupID?" * Invalid Broadcast group ID":Utils::BroadcastGroupID_to_name(bgID));
-            Log::logout("    Period of time     : 0x%02X (%u days)\n", PeriodOfTime, PeriodOfTime);
+            LOGOUT("    Date               : %s\n", Utils::mjd_to_string(Date));
+            LOGOUT("    Broadcast group ID : 0x%02X (%s)\n", bgID, invalidBroadcastGroupID?" * Invalid Broadcast group ID":Utils::BroadcastGroupID_to_name(bgID));
+            LOGOUT("    Period of time     : 0x%02X (%u days)\n", PeriodOfTime, PeriodOfTime);
 
             if (invalidBroadcastGroupID) {
                 returnCode = 0xA1FE;  // Other error
@@ -1299,45 +1440,45 @@ namespace Cas {
             // Copy the relevant message control information to the temporary area and rewrite the data there
             memcpy(pMSG, pMESSAGE(bgID), sizeof(MESSAGE_t));
 
-            Log::logout("    Information on the card\n");
-            Log::logout("        Status       : 0x%02X\n", pMSG->status);
-            Log::logout("        State date   : %s\n", Utils::mjd_to_string(ld_be16(pMSG->start_date)));
-            Log::logout("        Grace period : 0x%02X (%u)\n", pMSG->delayed_displaying_period, pMSG->delayed_displaying_period);
+            LOGOUT("    Information on the card\n");
+            LOGOUT("        Status       : 0x%02X\n", pMSG->status);
+            LOGOUT("        State date   : %s\n", Utils::mjd_to_string(ld_be16(pMSG->start_date)));
+            LOGOUT("        Grace period : 0x%02X (%u)\n", pMSG->delayed_displaying_period, pMSG->delayed_displaying_period);
 
             uint16_t cmpDate;
             bool ovf;
             switch (pMSG->status) {
                 case MSG_STS_DoNotShow:  // 0x00 : Hide message
                     returnCode = 0xA101;
-                    Log::logout("    * EMD disabled for message hide state\n");
+                    LOGOUT("    * EMD disabled for message hide state\n");
                     break;
 
                 case MSG_STS_Unused:  // 0x01 : Unused card (status where only NHK 0x01 exists)
                     returnCode = 0xA101;
                     if (!Date && !PeriodOfTime) {  // Clear message control area if date and grace period are 0
-                        Log::logout("    * Execute message deletion\n");
+                        LOGOUT("    * Execute message deletion\n");
                         memset(pMSG, 0x00, sizeof(MESSAGE_t));
 
                     } else if (PeriodOfTime == 0xff) {  // Do nothing if the grace period is 0xff
-                        Log::logout("    * Grace period disabled\n");
+                        LOGOUT("    * Grace period disabled\n");
 
                     } else {
                         ovf = (((uint32_t)Date + (uint32_t)PeriodOfTime) > 0xffff);
                         if (ovf) {
-                            Log::logout("    * Date + grace period 16bit overflow\n");
+                            LOGOUT("    * Date + grace period 16bit overflow\n");
                             returnCode = 0x2100;
                         }
 
                         pMSG->status = MSG_STS_DuringDisplayGracePeriodOrDisplay;  // Change status to "in display grace period or display"
                         st_be16(pMSG->start_date, Date);                           // Update start date
                         pMSG->delayed_displaying_period = PeriodOfTime;             // Update grace period
-                        Log::logout("    * Update status, start date, and grace period\n");
+                        LOGOUT("    * Update status, start date, and grace period\n");
                     }
                     break;
 
                 case MSG_STS_DuringDisplayGracePeriodOrDisplay:  // 0x02 : During display grace period or being displayed (status where only NHK 0x01 exists)
                     if ((Date < ld_be16(pMSG->start_date)) && (PeriodOfTime != 0xff)) {
-                        Log::logout("    * Update start date and grace period\n");
+                        LOGOUT("    * Update start date and grace period\n");
                         st_be16(pMSG->start_date, Date);
                         pMSG->delayed_displaying_period = PeriodOfTime;
                     }
@@ -1345,14 +1486,14 @@ namespace Cas {
                     ovf = (((uint32_t)ld_be16(pMSG->start_date) + (uint32_t)pMSG->delayed_displaying_period) > 0xffff);
                     if (ovf) {
                         returnCode = 0x2100;
-                        Log::logout("    * Date in card + grace period 16bit overflow\n");
+                        LOGOUT("    * Date in card + grace period 16bit overflow\n");
                     } else {
                         cmpDate = ld_be16(pMSG->start_date) + pMSG->delayed_displaying_period;
                         if (Date > cmpDate) {
-                            Log::logout("    * Displaying message\n");
+                            LOGOUT("    * Displaying message\n");
                             returnCode = 0x2100;
                         } else {
-                            Log::logout("    * Waiting for message display\n");
+                            LOGOUT("    * Waiting for message display\n");
                             returnCode = 0xA101;
                         }
                     }
@@ -1361,10 +1502,10 @@ namespace Cas {
                 case MSG_STS_Showing:  // 0x03 : Displaying message
                 default:
                     if (ld_be16(cmd->FixedPart.Date) > ld_be16(pMSG->expiry_date)) {
-                        Log::logout("    * Displaying message / Invalid date\n");
+                        LOGOUT("    * Displaying message / Invalid date\n");
                         returnCode = 0xA101;
                     } else {
-                        Log::logout("    * Displaying message\n");
+                        LOGOUT("    * Displaying message\n");
                         returnCode = 0x2100;
                     }
                     break;
@@ -1372,12 +1513,12 @@ namespace Cas {
         }
 
     EXIT_FUNCTION:
-        Log::logout("    Return code        : 0x%04X\n", returnCode);
+        LOGOUT("    Return code        : 0x%04X\n", returnCode);
 
         // If it ends normally, copy the information from the temporary area to the corresponding message control area
         if (bgID < BGID_COUNT) {
             pMSG->checkDigit = Utils::calc_message_check_digit(pMSG);
-            memcpy(pMESSAGE(bgID), pMSG, sizeof(MESSAGE_t));
+            writeCardImage(pMESSAGE(bgID), pMSG, sizeof(MESSAGE_t));
         }
 
         res->ProtocolNumber = 0;
@@ -1401,7 +1542,7 @@ namespace Cas {
         }
         st_be16(p, swCode);
 
-        return resCopy(pbRecvBuffer, pcbRecvLength, recvTemp, resSize);
+        return resReturn(pbRecvBuffer, pcbRecvLength, res, resSize);
     }
 
     //
@@ -1455,33 +1596,33 @@ namespace Cas {
 
         CMD *cmd = (CMD *)pbSendBuffer;
 
-        uint8_t recvTemp[300] = { 0 };
-        RES *res = (RES *)recvTemp;
+        uint8_t recvTemp[sizeof(RES)];
+        RES *res = (RES *)resArea(pbRecvBuffer, pcbRecvLength, pbSendBuffer, cbSendLength, recvTemp, sizeof(recvTemp));
         DWORD resSize = sizeof(RES);
 
         uint8_t bgID = 0xff;
 
-        Log::logout("[CHK command received]\n");
+        LOGOUT("[CHK command received]\n");
 
         {
             if ((cbSendLength < 5) || (cmd->Lc != (cbSendLength - 6)) || (cmd->Lc > CHK_DATA_MAX_LENGTH)) {
-                Log::logout("    Command length abnormal\n");
+                LOGOUT("    Command length abnormal\n");
                 return resError(pbRecvBuffer, pcbRecvLength, 0x6700);
             }
 
             if (cmd->P1 || cmd->P2) {
-                Log::logout("    P1 / P2 abnormal: [ P1:0x%02X / P2: 0x%02X ]\n", cmd->P1, cmd->P2);
+                LOGOUT("    P1 / P2 abnormal: [ P1:0x%02X / P2: 0x%02X ]\n", cmd->P1, cmd->P2);
                 return resError(pbRecvBuffer, pcbRecvLength, 0x6A86);
             }
 
             uint8_t Le = *(pbSendBuffer + cbSendLength - 1);
             if (Le) {
-                Log::logout("    Le abnormal: 0x%02X\n", Le);
+                LOGOUT("    Le abnormal: 0x%02X\n", Le);
                 return resError(pbRecvBuffer, pcbRecvLength, 0x6700);
             }
 
             if (cmd->Lc < 8) {
-                Log::logout("    Invalid data length (less than 8 bytes)\n");
+                LOGOUT("    Invalid data length (less than 8 bytes)\n");
                 returnCode = 0xA104;  // Security error
                 goto EXIT_FUNCTION;
             }
@@ -1491,10 +1632,10 @@ namespace Cas {
                                             (cmd->FixedPart.ProtocolNumber != 0x41) && (cmd->FixedPart.ProtocolNumber != 0x45));
             bool invalidBroadcastGroupID = (bgID >= BGID_COUNT);
 
-            Log::logout("    Date               : %s\n", Utils::mjd_to_string(ld_be16(cmd->FixedPart.Date)));
-            Log::logout("    Protocol number    : 0x%02X%s\n", cmd->FixedPart.ProtocolNumber, invalidProtocolNumber?" * Non-operational protocol number":"");
-            Log::logout("    Broadcast group ID : 0x%02X (%s)\n", bgID, invalidBroadcastGroupID?" * Invalid Broadcast group ID":Utils::BroadcastGroupID_to_name(bgID));
-            Log::logout("    Work key ID        : 0x%02X\n", cmd->FixedPart.WorkKeyID);
+            LOGOUT("    Date               : %s\n", Utils::mjd_to_string(ld_be16(cmd->FixedPart.Date)));
+            LOGOUT("    Protocol number    : 0x%02X%s\n", cmd->FixedPart.ProtocolNumber, invalidProtocolNumber?" * Non-operational protocol number":"");
+            LOGOUT("    Broadcast group ID : 0x%02X (%s)\n", bgID, invalidBroadcastGroupID?" * Invalid Broadcast group ID":Utils::BroadcastGroupID_to_name(bgID));
+            LOGOUT("    Work key ID        : 0x%02X\n", cmd->FixedPart.WorkKeyID);
 
             if (invalidProtocolNumber) {
                 returnCode = 0xA102;  // Non-operational protocol number error
@@ -1511,7 +1652,7 @@ namespace Cas {
             TIER_t *pT = pTIER(bgID);
 
             if (!pT->ActivationState) {
-                Log::logout("    * Non-contractual broadcast\n");
+                LOGOUT("    * Non-contractual broadcast\n");
                 returnCode = 0xA103;  // Non-contract
                 goto EXIT_FUNCTION;
             }
@@ -1519,30 +1660,31 @@ namespace Cas {
             // Get work key
             uint64_t key = getWorkKey(cmd->FixedPart.BroadcastGroupID, cmd->FixedPart.WorkKeyID);
             if (!key) {
-                Log::logout("    * No work key\n");
+                LOGOUT("    * No work key\n");
                 returnCode = 0xA103;  // Non-contract
                 goto EXIT_FUNCTION;
             }
 
             // Message decryption
+            // Only the clear part is copied to the plaintext view, the encrypted part is decrypted straight into it
             uint8_t tmp[300];
-            memcpy(tmp, cmd, cbSendLength);
-
             uint32_t decodingStartPoint = offsetof(CMD, Cvi.ProgramType);
+            memcpy(tmp, cmd, decodingStartPoint);
+            tmp[ cbSendLength - 1 ] = pbSendBuffer[ cbSendLength - 1 ];  // Le
             uint32_t decodingLength = (uint16_t)(cbSendLength - decodingStartPoint - 1);
             const uint8_t *in = (const uint8_t *)cmd + decodingStartPoint;
             uint8_t *out = &tmp[ decodingStartPoint ];
-            Crypto::decrypt(out, in, decodingLength, key, cmd->FixedPart.ProtocolNumber);
+            Crypto::decrypt(out, in, decodingLength, getKeyContext(key, cmd->FixedPart.ProtocolNumber));
             cmd = (CMD *)tmp;
 
-            Log::logout("    Decryption key     : 0x%016llX\n", key);
-            Log::logout("    Decrypted data     : [ ");
+            LOGOUT("    Decryption key     : 0x%016llX\n", key);
+            LOGOUT("    Decrypted data     : [ ");
             Log::logout_dump(out, decodingLength, 0);
-            Log::logout(" ]\n");
+            LOGOUT(" ]\n");
 
-            Log::logout("    Judgment type      : 0x%02X\n", cmd->Cvi.ProgramType);
-            Log::logout("    Recording control  : 0x%02X\n", cmd->Cvi.RecordingControl);
-            Log::logout("    Unknown value      : 0x%02X\n", cmd->Cvi.UnknownValue);
+            LOGOUT("    Judgment type      : 0x%02X\n", cmd->Cvi.ProgramType);
+            LOGOUT("    Recording control  : 0x%02X\n", cmd->Cvi.RecordingControl);
+            LOGOUT("    Unknown value      : 0x%02X\n", cmd->Cvi.UnknownValue);
 
             uint8_t ProgramType = cmd->Cvi.ProgramType & 0x03;  // Truncate to 2 bits
             if ( ProgramType == 0) {  // Always returns 0xA1FE if the judgment type is 0
@@ -1560,26 +1702,26 @@ namespace Cas {
             bool Contracted;
             returnCode = 0xA1FE;
             while (remain > 0) {
-                Log::logout("\n        Function number : 0x%02X ", *p);
+                LOGOUT("\n        Function number : 0x%02X ", *p);
                 switch (*p) {
                     case 0x52:  // CheckContract bitmap
                         Contracted = processNano52(pT, p);
-                        Log::logout("            Contract status          : ");
+                        LOGOUT("            Contract status          : ");
                         if (!checkExpiryDate(pT, ld_be16(cmd->FixedPart.Date), 0x00) || (pT->ActivationState != 2)) {
-                            Log::logout("Expired %s\n", Utils::mjd_to_string(ld_be16(pT->ExpiryDate)));
+                            LOGOUT("Expired %s\n", Utils::mjd_to_string(ld_be16(pT->ExpiryDate)));
                             returnCode = 0x8902;
                         } else if (Contracted) {
-                            Log::logout("Purchased\n");
+                            LOGOUT("Purchased\n");
                             returnCode = 0x0800;
                         } else {
-                            Log::logout("No contract\n");
+                            LOGOUT("No contract\n");
                             returnCode = 0x8901;
                         }
                         break;
 
                     default:
-                        Log::logout("<Unsupported functions>\n");
-                        Log::logout("\n");
+                        LOGOUT("<Unsupported functions>\n");
+                        LOGOUT("\n");
                         break;
                 }
 
@@ -1588,14 +1730,14 @@ namespace Cas {
             }
 
             if (remain != 0) {  // Variable length parameter length error?
-                Log::logout("    * Detect errors in variable length data\n");
+                LOGOUT("    * Detect errors in variable length data\n");
                 returnCode = 0x0A104;  // Security error
                 goto EXIT_FUNCTION;
             }
         }
 
     EXIT_FUNCTION:
-        Log::logout("    Return code        : 0x%04X\n", returnCode);
+        LOGOUT("    Return code        : 0x%04X\n", returnCode);
 
         res->ProtocolNumber = 0;
         res->UnitLength = offsetof(RES, SW1) - offsetof(RES, UnitLength) - 1;
@@ -1609,7 +1751,7 @@ namespace Cas {
         st_be16(&res->PrepaidMinimumBalance, 0x0000);
         st_be16(&res->SW1, swCode);
 
-        return resCopy(pbRecvBuffer, pcbRecvLength, recvTemp, resSize);
+        return resReturn(pbRecvBuffer, pcbRecvLength, res, resSize);
     }
 
     //
@@ -1653,26 +1795,26 @@ namespace Cas {
 
         CMD *cmd = (CMD *)pbSendBuffer;
 
-        uint8_t recvTemp[300] = { 0 };
-        RES *res = (RES *)recvTemp;
+        uint8_t recvTemp[sizeof(RES)];
+        RES *res = (RES *)resArea(pbRecvBuffer, pcbRecvLength, pbSendBuffer, cbSendLength, recvTemp, sizeof(recvTemp));
         DWORD resSize = sizeof(RES);
 
-        Log::logout("[Request power control information command]\n");
+        LOGOUT("[Request power control information command]\n");
 
         if ((cbSendLength != sizeof(CMD)) || (cmd->Lc != (cbSendLength - 6))) {
-            Log::logout("    Command length abnormal\n");
+            LOGOUT("    Command length abnormal\n");
             return resError(pbRecvBuffer, pcbRecvLength, 0x6700);
             return true;
         }
 
         if (cmd->P1 || cmd->P2) {
-            Log::logout("    P1 / P2 abnormal: [ P1:0x%02X / P2: 0x%02X ]\n", cmd->P1, cmd->P2);
+            LOGOUT("    P1 / P2 abnormal: [ P1:0x%02X / P2: 0x%02X ]\n", cmd->P1, cmd->P2);
             return resError(pbRecvBuffer, pcbRecvLength, 0x6A86);
         }
 
         uint8_t Le = *(pbSendBuffer + cbSendLength - 1);
         if (Le) {
-            Log::logout("    Le abnormal: 0x%02X\n", Le);
+            LOGOUT("    Le abnormal: 0x%02X\n", Le);
             return resError(pbRecvBuffer, pcbRecvLength, 0x6700);
         }
 
@@ -1691,20 +1833,20 @@ namespace Cas {
 
         if (BroadcastGroupID == 0xff) {
             returnCode = 0xA101;
-            Log::logout("    No corresponding data\n");
+            LOGOUT("    No corresponding data\n");
             goto EXIT_FUNCTION;
         }
 
-        Log::logout("    Broadcast Group ID            : 0x%02X\n", BroadcastGroupID);
-        Log::logout("    Reference Power on start date : %s\n", Utils::mjd_to_string(ld_be16(pTIER(BroadcastGroupID)->ExpiryDate)));
-        Log::logout("    Power on start date offset    : 0x%02X (%u)\n",pTIER(BroadcastGroupID)->PowerOn.PowerOnStartDateOffset, pTIER(BroadcastGroupID)->PowerOn.PowerOnStartDateOffset);
-        Log::logout("    Power on period               : 0x%02X (%u)\n",pTIER(BroadcastGroupID)->PowerOn.PowerOnPeriod, pTIER(BroadcastGroupID)->PowerOn.PowerOnPeriod);
-        Log::logout("    Power supply hold time        : 0x%02X (%u)\n", pTIER(BroadcastGroupID)->PowerOn.PowerSupplyHoldTime, pTIER(BroadcastGroupID)->PowerOn.PowerSupplyHoldTime);
-        Log::logout("    Receiving network             : 0x%04X\n", ld_be16(pTIER(BroadcastGroupID)->PowerOn.ReceiveNetwork));
-        Log::logout("    Receiving TS                  : 0x%04X\n", ld_be16(pTIER(BroadcastGroupID)->PowerOn.ReceiveTS));
+        LOGOUT("    Broadcast Group ID            : 0x%02X\n", BroadcastGroupID);
+        LOGOUT("    Reference Power on start date : %s\n", Utils::mjd_to_string(ld_be16(pTIER(BroadcastGroupID)->ExpiryDate)));
+        LOGOUT("    Power on start date offset    : 0x%02X (%u)\n",pTIER(BroadcastGroupID)->PowerOn.PowerOnStartDateOffset, pTIER(BroadcastGroupID)->PowerOn.PowerOnStartDateOffset);
+        LOGOUT("    Power on period               : 0x%02X (%u)\n",pTIER(BroadcastGroupID)->PowerOn.PowerOnPeriod, pTIER(BroadcastGroupID)->PowerOn.PowerOnPeriod);
+        LOGOUT("    Power supply hold time        : 0x%02X (%u)\n", pTIER(BroadcastGroupID)->PowerOn.PowerSupplyHoldTime, pTIER(BroadcastGroupID)->PowerOn.PowerSupplyHoldTime);
+        LOGOUT("    Receiving network             : 0x%04X\n", ld_be16(pTIER(BroadcastGroupID)->PowerOn.ReceiveNetwork));
+        LOGOUT("    Receiving TS                  : 0x%04X\n", ld_be16(pTIER(BroadcastGroupID)->PowerOn.ReceiveTS));
 
     EXIT_FUNCTION:
-        Log::logout("    Return code                   : 0x%04X\n", returnCode);
+        LOGOUT("    Return code                   : 0x%04X\n", returnCode);
 
         res->ProtocolNumber = 0;
         res->UnitLength = offsetof(RES, SW1) - offsetof(RES, UnitLength) - 1;
@@ -1724,7 +1866,7 @@ namespace Cas {
         }
         st_be16(&res->SW1, swCode);
 
-        return resCopy(pbRecvBuffer, pcbRecvLength, recvTemp, resSize);
+        return resReturn(pbRecvBuffer, pcbRecvLength, res, resSize);
     }
 
     //
@@ -1750,26 +1892,26 @@ namespace Cas {
 
         bool sts = false;
         if (cbSendLength == sizeof(Toshiba) && !memcmp(pbSendBuffer, Toshiba, sizeof(Toshiba))) {
-            Log::logout("[Toshiba command]\n");
+            LOGOUT("[Toshiba command]\n");
             selectBC01 = false;
             ulStatus |= 0x01;
             sts = true;
         } else if (cbSendLength == sizeof(Cmd8054) && !memcmp(pbSendBuffer, Cmd8054, sizeof(Cmd8054))) {
-            Log::logout("[8054 command]\n");
+            LOGOUT("[8054 command]\n");
             selectBC01 = false;
             ulStatus |= 0x02;
             sts = true;
         } else if (cbSendLength == sizeof(PinSet) && !memcmp(pbSendBuffer, PinSet, sizeof(PinSet))) {
-            Log::logout("[PinSet command]\n");
+            LOGOUT("[PinSet command]\n");
             selectBC01 = false;
             ulStatus |= 0x04;
             sts = true;
         } else if (cbSendLength == sizeof(PinClear) && !memcmp(pbSendBuffer, PinClear, sizeof(PinClear))) {
-            Log::logout("[PinClear command]\n");
+            LOGOUT("[PinClear command]\n");
             selectBC01 = false;
             sts = true;
         } else if (cbSendLength == sizeof(SelectBC01) && !memcmp(pbSendBuffer, SelectBC01, sizeof(SelectBC01))) {
-            Log::logout("[SelectBC01 command]\n");
+            LOGOUT("[SelectBC01 command]\n");
             selectBC01 = ul;
             sts = true;
         }
@@ -1779,7 +1921,7 @@ namespace Cas {
             RES *res = (RES *)pbRecvBuffer;
             st_be16(&res->SW1, 0x9000);
             if (!ul && ulStatus == 0x07) {
-                Log::logout("    * Successfully UL\n");
+                LOGOUT("    * Successfully UL\n");
                 ul = true;
             }
         }
@@ -1797,10 +1939,10 @@ namespace Cas {
         if (cbSendLength != 5 && cbSendLength != 7) return false;
         if (pbSendBuffer[0] != 0x00 || pbSendBuffer[1] != 0xb0) return false;
 
-        Log::logout("[Memory read command]\n");
+        LOGOUT("[Memory read command]\n");
 
         if (*pcbRecvLength < 2) {
-            Log::logout("    Insufficient receive buffer (%lu)\n",  *pcbRecvLength);
+            LOGOUT("    Insufficient receive buffer (%lu)\n",  *pcbRecvLength);
             return false;
         }
 
@@ -1808,7 +1950,7 @@ namespace Cas {
         uint16_t size = 0;
         if (cbSendLength == 7) {
             if (pbSendBuffer[4]) {
-                Log::logout("    Byte length error\n");
+                LOGOUT("    Byte length error\n");
                 return false;
             }
             size = ld_be16(pbSendBuffer + 5);
@@ -1832,18 +1974,18 @@ namespace Cas {
         *pcbRecvLength = bs + 2;
 
         if (!selectBC01) {
-            Log::logout("    * BC01 Not Selected\n");
+            LOGOUT("    * BC01 Not Selected\n");
         } else {
-            Log::logout("    First address : ");
+            LOGOUT("    First address : ");
             Log::logout_address_name(addr);
-            Log::logout("    Last address  : ");
+            LOGOUT("    Last address  : ");
             Log::logout_address_name(addr + size - 1);
         }
 
-        Log::logout("    Byte length   : 0x%04X (%u)\n", size, size);
-        Log::logout("    Byte data     : ");
+        LOGOUT("    Byte length   : 0x%04X (%u)\n", size, size);
+        LOGOUT("    Byte data     : ");
         Log::logout_dump(&cardImage[ addr ], bs, 5);
-        if (overBytes) Log::logout("    Data overflow : [%u bytes over]\n", overBytes);
+        if (overBytes) LOGOUT("    Data overflow : [%u bytes over]\n", overBytes);
 
         return true;
     }
@@ -1859,10 +2001,10 @@ namespace Cas {
         if (cbSendLength < 5) return false;
         if (pbSendBuffer[0] != 0x00 || pbSendBuffer[1] != 0xd6) return false;
 
-        Log::logout("[Memory write command]\n");
+        LOGOUT("[Memory write command]\n");
 
         if (*pcbRecvLength < 2) {
-            Log::logout("    Insufficient receive buffer (%lu)\n",  *pcbRecvLength);
+            LOGOUT("    Insufficient receive buffer (%lu)\n",  *pcbRecvLength);
             return false;
         }
 
@@ -1871,7 +2013,7 @@ namespace Cas {
         uint16_t offset = 5;
         if (size == 0) {
             if (cbSendLength < 7) {
-                Log::logout("    Command length error (%lu)\n", cbSendLength);
+                LOGOUT("    Command length error (%lu)\n", cbSendLength);
                 return false;
             }
             size = ld_be16(pbSendBuffer + 5);
@@ -1879,7 +2021,7 @@ namespace Cas {
         }
 
         if ((DWORD)(offset + size) != cbSendLength) {
-            Log::logout("    Command length error (%lu)\n", cbSendLength);
+            LOGOUT("    Command length error (%lu)\n", cbSendLength);
             return false;
         }
 
@@ -1892,6 +2034,7 @@ namespace Cas {
             }
             a %= sizeof(cardImage);
             cardImage[ a ] = src[i] ^ 0xff;
+            markDirty(&cardImage[ a ], 1);
             if ((a >= INFO_ADDR) && (a <= (INFO_ADDR + sizeof(INFO_t) - 1))) {
                 *writeID = true;
             }
@@ -1900,18 +2043,18 @@ namespace Cas {
         *pcbRecvLength = 2;
 
         if (!selectBC01) {
-            Log::logout("    * BC01 Not Selected\n");
+            LOGOUT("    * BC01 Not Selected\n");
         } else {
-            Log::logout("    First address : ");
+            LOGOUT("    First address : ");
             Log::logout_address_name(addr);
-            Log::logout("    Last address  : ");
+            LOGOUT("    Last address  : ");
             Log::logout_address_name(addr + size - 1);
         }
 
-        Log::logout("    Byte length   : 0x%04X (%u)\n", size, size);
-        Log::logout("    Byte data     : ");
+        LOGOUT("    Byte length   : 0x%04X (%u)\n", size, size);
+        LOGOUT("    Byte data     : ");
         Log::logout_dump(&cardImage[ addr ], size, 5);
-        if (overBytes) Log::logout("    Data overflow : [%u bytes over]\n", overBytes);
+        if (overBytes) LOGOUT("    Data overflow : [%u bytes over]\n", overBytes);
 
         return true;
     }
@@ -1946,10 +2089,10 @@ namespace Cas {
             setWorkKey(BroadcastGroupID, k.WorkKeyID, ld_be64(k.Key), false);
         }
 
-        Log::logout("[Update work key of the specified work key ID]\n");
-        Log::logout("            Work key ID : 0x%02X\n", k.WorkKeyID);
-        Log::logout("            Work key    : 0x%016llX\n", ld_be64(k.Key));
-        Log::logout("%s", (!updateEnable) ? "            * Not executed\n" : "");
+        LOGOUT("[Update work key of the specified work key ID]\n");
+        LOGOUT("            Work key ID : 0x%02X\n", k.WorkKeyID);
+        LOGOUT("            Work key    : 0x%016llX\n", ld_be64(k.Key));
+        LOGOUT("%s", (!updateEnable) ? "            * Not executed\n" : "");
     }
 
     //
@@ -1977,14 +2120,14 @@ namespace Cas {
         memcpy(&con, &cmd->con, len);
         if (updateEnable) memcpy(&pT->Bitmap, &con, sizeof(con));
 
-        Log::logout("[Update contract bit flag]\n");
-        Log::logout("            Data byte length         : 0x%02X (%u)\n", cmd->Length, cmd->Length);
+        LOGOUT("[Update contract bit flag]\n");
+        LOGOUT("            Data byte length         : 0x%02X (%u)\n", cmd->Length, cmd->Length);
         if (len) {
-            Log::logout("            Contract bit information : ");
+            LOGOUT("            Contract bit information : ");
             Log::logout_bitmap(con.bitmap, len, 39);
         }
-        Log::logout("\n");
-        Log::logout("%s", (!updateEnable) ? "            * Not executed\n" : "");
+        LOGOUT("\n");
+        LOGOUT("%s", (!updateEnable) ? "            * Not executed\n" : "");
     }
 
     //
@@ -2028,15 +2171,18 @@ namespace Cas {
 
             pINFO()->GroupID_Flag1 |= (1 << grpID);
             pINFO()->GroupID_Flag2 |= (1 << grpID);
+
+            markDirty(p, sizeof(GROUP_ID_t));
+            markDirty(&pINFO()->GroupID_Flag1, 2);
         }
 
-        Log::logout("[Add/Update group ID]\n");
-        Log::logout("            Data byte length : 0x%02X (%u)\n", cmd->Length, cmd->Length);
-        Log::logout("            Group ID type    : %u\n", grpID);
-        Log::logout("            Group ID         : 0x%012llX\n", id);
-        Log::logout("            Master key (Km)  : 0x%016llX\n", km);
-        Log::logout("            Group ID string  : %s\n", Utils::cardID_to_string(id));
-        Log::logout("%s", (!updateEnable) ? "            * Not executed\n" : "");
+        LOGOUT("[Add/Update group ID]\n");
+        LOGOUT("            Data byte length : 0x%02X (%u)\n", cmd->Length, cmd->Length);
+        LOGOUT("            Group ID type    : %u\n", grpID);
+        LOGOUT("            Group ID         : 0x%012llX\n", id);
+        LOGOUT("            Master key (Km)  : 0x%016llX\n", km);
+        LOGOUT("            Group ID string  : %s\n", Utils::cardID_to_string(id));
+        LOGOUT("%s", (!updateEnable) ? "            * Not executed\n" : "");
     }
 
     //
@@ -2068,12 +2214,13 @@ namespace Cas {
         if (updateEnable) {
             pINFO()->GroupID_Flag1 &= ~(1 << g.grpID);  // Just clear the flag
             pINFO()->GroupID_Flag2 &= ~(1 << g.grpID);
+            markDirty(&pINFO()->GroupID_Flag1, 2);
         }
 
-        Log::logout("[Group ID invalidation]\n");
-        Log::logout("            Data byte length : 0x%02X (%u)\n", cmd->Length, cmd->Length);
-        Log::logout("            Group ID type    : %u\n", g.grpID);
-        Log::logout("%s", (!updateEnable) ? "            * Not executed\n" : "");
+        LOGOUT("[Group ID invalidation]\n");
+        LOGOUT("            Data byte length : 0x%02X (%u)\n", cmd->Length, cmd->Length);
+        LOGOUT("            Group ID type    : %u\n", g.grpID);
+        LOGOUT("%s", (!updateEnable) ? "            * Not executed\n" : "");
     }
 
     //
@@ -2107,13 +2254,13 @@ namespace Cas {
             memcpy(&pT->PowerOn, &pow, sizeof(pow));
         }
 
-        Log::logout("[Update power control information]\n");
-        Log::logout("            Power on start date offset : 0x%02X (%u)\n", pow.PowerOnStartDateOffset, pow.PowerOnStartDateOffset);
-        Log::logout("            Power on period            : 0x%02X (%u)\n", pow.PowerOnPeriod, pow.PowerOnPeriod);
-        Log::logout("            Power supply hold time     : 0x%02X (%u)\n", pow.PowerSupplyHoldTime, pow.PowerSupplyHoldTime);
-        Log::logout("            Receiving network          : 0x%04X\n", ld_be16(pow.ReceiveNetwork));
-        Log::logout("            Receiving TS               : 0x%04X\n", ld_be16(pow.ReceiveTS));
-        Log::logout("%s", (!updateEnable) ? "            * Not executed\n" : "");
+        LOGOUT("[Update power control information]\n");
+        LOGOUT("            Power on start date offset : 0x%02X (%u)\n", pow.PowerOnStartDateOffset, pow.PowerOnStartDateOffset);
+        LOGOUT("            Power on period            : 0x%02X (%u)\n", pow.PowerOnPeriod, pow.PowerOnPeriod);
+        LOGOUT("            Power supply hold time     : 0x%02X (%u)\n", pow.PowerSupplyHoldTime, pow.PowerSupplyHoldTime);
+        LOGOUT("            Receiving network          : 0x%04X\n", ld_be16(pow.ReceiveNetwork));
+        LOGOUT("            Receiving TS               : 0x%04X\n", ld_be16(pow.ReceiveTS));
+        LOGOUT("%s", (!updateEnable) ? "            * Not executed\n" : "");
     }
 
     //
@@ -2140,12 +2287,12 @@ namespace Cas {
         memset(&f, 0x00, sizeof(FNC_t));
         memcpy(&f, &cmd->fn, len);
 
-        Log::logout("[Multi-function]\n");
+        LOGOUT("[Multi-function]\n");
 
         bool update = false;
         switch (f.FunctionNumber) {
             case 0x01:  // InvalidateTier
-                Log::logout("            Deactivate broadcast information\n");
+                LOGOUT("            Deactivate broadcast information\n");
                 if (updateEnable) {
                     pT->ActivationState = 0;
                     update = true;
@@ -2153,16 +2300,17 @@ namespace Cas {
                 break;
 
             case 0x02:  // ResetUpdateNumbers
-                Log::logout("            reset update number\n");
+                LOGOUT("            reset update number\n");
                 if (updateEnable) {
                     st_be16(pT->UpdateNumber1, 0x0000);
                     st_be16(pMSG->UpdateNumber, 0x0000);
+                    markDirty(pMSG->UpdateNumber, sizeof(pMSG->UpdateNumber));  // pMSG is not a temporary area
                     update = true;
                 }
                 break;
 
             case 0xff:  // ResetTrial
-                Log::logout("            Reset trial viewing\n");
+                LOGOUT("            Reset trial viewing\n");
                 if (updateEnable) {
                     if (Ins == INS_EMM) {
                         pT->ActivationState = 1;
@@ -2174,10 +2322,10 @@ namespace Cas {
                 break;
 
             default:
-                Log::logout("            Unknown function number [0x%02X]\n", f.FunctionNumber);
+                LOGOUT("            Unknown function number [0x%02X]\n", f.FunctionNumber);
                 break;
         }
-        Log::logout("%s", (!update) ? "            * Not executed\n" : "");
+        LOGOUT("%s", (!update) ? "            * Not executed\n" : "");
     }
 
     //
@@ -2211,9 +2359,9 @@ namespace Cas {
             updateEnable = true;
         }
 
-        Log::logout("[Invalidate tier by specifying the card ID]\n");
-        Log::logout("            Destination card ID : 0x%012llX (%s)\n", ld_be48(id.CardID), Utils::cardID_to_string(ld_be48(id.CardID)));
-        Log::logout("%s", (!updateEnable) ? "            * Not executed\n" : "");
+        LOGOUT("[Invalidate tier by specifying the card ID]\n");
+        LOGOUT("            Destination card ID : 0x%012llX (%s)\n", ld_be48(id.CardID), Utils::cardID_to_string(ld_be48(id.CardID)));
+        LOGOUT("%s", (!updateEnable) ? "            * Not executed\n" : "");
     }
 
     //
@@ -2251,16 +2399,16 @@ namespace Cas {
             isExecuted = true;
         }
 
-        Log::logout("[Enable trial viewing]\n");
-        Log::logout("            Trial viewing days   : %u days\n", d.Days);
+        LOGOUT("[Enable trial viewing]\n");
+        LOGOUT("            Trial viewing days   : %u days\n", d.Days);
         if (isExecuted) {
-            Log::logout("            Trial viewing period : ");
-            Log::logout("%s", Utils::mjd_to_string(date));
-            Log::logout(" ~ ");
-            Log::logout("%s", Utils::mjd_to_string(ExpiryDate));
-            Log::logout("\n");
+            LOGOUT("            Trial viewing period : ");
+            LOGOUT("%s", Utils::mjd_to_string(date));
+            LOGOUT(" ~ ");
+            LOGOUT("%s", Utils::mjd_to_string(ExpiryDate));
+            LOGOUT("\n");
         }
-        Log::logout("%s", (!isExecuted) ? "            * Not executed\n" : "");
+        LOGOUT("%s", (!isExecuted) ? "            * Not executed\n" : "");
     }
 
     //
@@ -2295,11 +2443,11 @@ namespace Cas {
             }
         }
 
-        Log::logout("[Check contract bit flag]\n");
-        Log::logout("            Data byte length         : 0x%02X (%u)\n", cmd->Length, cmd->Length);
-        Log::logout("            Contract bit information : ");
+        LOGOUT("[Check contract bit flag]\n");
+        LOGOUT("            Data byte length         : 0x%02X (%u)\n", cmd->Length, cmd->Length);
+        LOGOUT("            Contract bit information : ");
         Log::logout_bitmap(con.bitmap, len, 39);
-        Log::logout("\n");
+        LOGOUT("\n");
 
         return Contracted;
     }
@@ -2380,6 +2528,7 @@ namespace Cas {
         bool cardImageUpdateEnable = false;
         if (cardImageUpdate) {
             cardImageUpdateEnable = updateTierWorkKey(pTIER(BroadcastGroupID), WorkKeyID, key);
+            if (cardImageUpdateEnable) markDirty(pTIER(BroadcastGroupID), sizeof(TIER_t));
         }
 
         return cardImageUpdateEnable;
@@ -2421,6 +2570,7 @@ namespace Cas {
         CARD_STATUS_t *pSTS = pCARDSTATUS();
         st_be16(pSTS->card_status1, sts);
         st_be16(pSTS->card_status2, sts);
+        markDirty(pSTS, sizeof(CARD_STATUS_t));
     }
 
     // Get the card status
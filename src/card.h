@@ -6,6 +6,7 @@
 #include <PCSC/wintypes.h>
 #endif
 #include <inttypes.h>
+#include "crypto.h"
 #include "key_manager.h"
 
 // The starting address of the area in the card image
@@ -15,6 +16,11 @@
 #define TIER_ADDR          (0x0100)
 #define MESSAGE_ADDR       (0x13c0)
 
+#define CARD_IMAGE_SIZE    (7680)
+#define DIRTY_RANGE_COUNT  (8)  // Maximum number of separately tracked modified ranges of the card image
+#define ECM_CACHE_WAYS     (2)  // Number of cached ECM responses per broadcast group ID
+#define KEY_CACHE_COUNT    (8)  // Number of expanded keys kept by each card
+
 namespace Cas {
 
     // Structure of the ID area in the card image
@@ -91,14 +97,51 @@ namespace Cas {
         uint8_t checkDigit;
     } MESSAGE_t;
 
+    // Range of the card image modified since the last save
+    typedef struct {
+        uint16_t begin;
+        uint16_t end;
+    } RANGE_t;
+
+    // Set of modified ranges (overlapping or adjacent ranges are merged, and everything collapses into one range when full)
+    struct DirtyRanges {
+        RANGE_t range[DIRTY_RANGE_COUNT];
+        int count = 0;
+
+        void add(uint16_t begin, uint16_t end);
+        void add(const DirtyRanges &ranges);
+    };
+
+    // Cached ECM response
+    // Replayed when the identical ECM is received again and the card image has not changed in the meantime
+    typedef struct {
+        bool valid;
+        uint32_t hash;                          // Hash of the whole command
+        uint64_t generation;                    // Card image generation the response was created with
+        uint8_t cmdLength;
+        uint8_t cmd[ECM_DATA_MAX_LENGTH + 6];
+        uint8_t resLength;
+        uint8_t res[32];
+    } ECM_CACHE_t;
+
     class Card {
     private:
-        uint8_t cardImage[7680];
+        uint8_t cardImage[CARD_IMAGE_SIZE];
 
         bool ul = false;
         uint8_t ulStatus = 0x00;
         bool selectBC01 = false;
 
+        DirtyRanges dirty;
+        uint64_t imageGeneration = 0;           // Incremented on every modification of the card image
+
+        ECM_CACHE_t ecmCache[BGID_COUNT][ECM_CACHE_WAYS] = {};
+        uint8_t ecmCacheLastUsed[BGID_COUNT] = {};
+
+        Crypto::KeyContext keyCache[KEY_CACHE_COUNT];
+        uint32_t keyCacheStamp[KEY_CACHE_COUNT] = {};  // Last use of each entry (0: unused)
+        uint32_t keyCacheClock = 0;
+
         void processNano10(TIER_t *pT, uint8_t BroadcastGroupID, uint8_t *p, bool updateEnable);
         void processNano11(TIER_t *pT, uint8_t *p, bool updateEnable);
         void processNano13(uint8_t *p, bool updateEnable);
@@ -115,6 +158,11 @@ namespace Cas {
         MESSAGE_t* pMESSAGE(uint8_t BroadcastGroupID);
         void setupCardImage(uint64_t *initID, uint64_t *initKm);
         void loadCardImage(uint64_t *initID, uint64_t *initKm);
+        void markDirty(const void *p, size_t size);
+        void writeCardImage(void *dst, const void *src, size_t size);
+        const Crypto::KeyContext &getKeyContext(uint64_t key, uint8_t protocol);
+        bool replayEcmCache(uint8_t BroadcastGroupID, LPCBYTE pbSendBuffer, DWORD cbSendLength, LPBYTE pbRecvBuffer, LPDWORD pcbRecvLength, LONG *result);
+        void storeEcmCache(uint8_t BroadcastGroupID, uint64_t generation, LPCBYTE pbSendBuffer, DWORD cbSendLength, const uint8_t *res, DWORD resSize);
         uint64_t findWorkKeyFromCardImage(uint8_t BroadcastGroupID, uint8_t WorkKeyID);
         uint64_t getWorkKey(uint8_t BroadcastGroupID, uint8_t WorkKeyID);
         bool updateTierWorkKey(TIER_t *pT, uint8_t WorkKeyID, uint64_t key);
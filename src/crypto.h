@@ -1,9 +1,45 @@
 #pragma once
 
 #include <inttypes.h>
+#include <stddef.h>
 
 namespace Crypto {
 
+    // Detect the CPU's instruction set extensions, self-test every usable kernel and bind the fastest one per protocol
+    // Until this is called, the portable interleaved kernels are used
+    void select_kernels(void);
+    const char *kernel_name(uint8_t protocol);  // Name of the kernel bound for the protocol number
+    const char *cpu_features(void);             // Instruction set extensions found by select_kernels()
+
+    // Key with its schedule expanded for one protocol number (build once with init_key, then reuse)
+    struct KeyContext {
+        uint64_t key;
+        uint8_t protocol;
+        uint32_t kext[ 16 ];  // Protocol 0x00/0x04 uses the first 4 entries
+    };
+
+    void init_key(KeyContext *kc, uint64_t key, uint8_t protocol);
+    void encrypt(uint8_t *out, const uint8_t *in, uint32_t len, const KeyContext &kc);
+    void decrypt(uint8_t *out, const uint8_t *in, uint32_t len, const KeyContext &kc);
+    uint32_t digest(const KeyContext &kc, const uint8_t *in, uint32_t len);
+
+    // Decrypt and check the falsification detection code (last 4 bytes of the plaintext) in a single pass
+    // The code covers prefix (clear bytes preceding the ciphertext) followed by the plaintext without the code
+    // Returns true if the code matches the calculated value, which is stored in *calcValue
+    bool decrypt_and_verify(uint8_t *out, const uint8_t *in, uint32_t len, const KeyContext &kc,
+                            const uint8_t *prefix, uint32_t prefixLen, uint32_t *calcValue);
+
+    // One message of a batched decryption
+    struct DecryptJob {
+        uint8_t *out;
+        const uint8_t *in;
+        uint32_t len;
+        const KeyContext *kc;
+    };
+
+    // Decrypt independent messages together (short messages are processed side by side in interleaved lanes)
+    void decrypt_many(const DecryptJob *jobs, size_t count);
+
     void encrypt(uint8_t *out, const uint8_t *in, uint32_t len, uint64_t key, uint8_t protocol);
     void decrypt(uint8_t *out, const uint8_t *in, uint32_t len, uint64_t key, uint8_t protocol);
     uint32_t digest(uint8_t protocol, uint64_t key, const uint8_t *in, uint32_t len);
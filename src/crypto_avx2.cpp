@@ -0,0 +1,52 @@
+#include "crypto_kernel.h"
+
+// Protocol 0x00/0x04 kernels with eight blocks in the 32-bit lanes of an AVX2 register
+// (built with AVX2 enabled; only selected when the CPU supports it)
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#include <immintrin.h>
+
+namespace Crypto {
+
+    namespace {
+        struct VecAVX2 {
+            typedef __m256i V;
+            static const int LANES = 8;
+
+            static inline V set1(uint32_t x) { return _mm256_set1_epi32((int)x); }
+            static inline V load(const uint32_t *p) { return _mm256_loadu_si256((const __m256i *)p); }
+            static inline void store(uint32_t *p, V x) { _mm256_storeu_si256((__m256i *)p, x); }
+            static inline V add16(V a, V b) { return _mm256_add_epi16(a, b); }
+            static inline V sub32(V a, V b) { return _mm256_sub_epi32(a, b); }
+            static inline V band(V a, V b) { return _mm256_and_si256(a, b); }
+            static inline V bor(V a, V b) { return _mm256_or_si256(a, b); }
+            static inline V bxor(V a, V b) { return _mm256_xor_si256(a, b); }
+            static inline V bandnot(V a, V b) { return _mm256_andnot_si256(a, b); }
+            template <int S> static inline V shl(V x) { return _mm256_slli_epi32(x, S); }
+            template <int S> static inline V shr(V x) { return _mm256_srli_epi32(x, S); }
+        };
+    }
+
+    //==============================================================================
+    const KERNEL_t *kernels_avx2(void)
+    {
+        static constexpr KERNEL_t kernels[ 2 ] = {
+            make_kernel<0x00, VectorEngine00<VecAVX2> >("avx2"),
+            make_kernel<0x04, VectorEngine00<VecAVX2> >("avx2")
+        };
+        return kernels;
+    }
+}
+
+#else
+
+namespace Crypto {
+
+    //==============================================================================
+    const KERNEL_t *kernels_avx2(void)
+    {
+        return NULL;
+    }
+}
+
+#endif
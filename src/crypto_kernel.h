@@ -0,0 +1,682 @@
+#pragma once
+
+// Cipher kernels shared by crypto.cpp and the translation units built for instruction set extensions
+// (crypto_sse2.cpp, crypto_avx2.cpp, crypto_neon.cpp); only those files include this header
+
+#include "crypto.h"
+#include "ldst.h"
+
+namespace Crypto {
+
+    static const int MAX_DECRYPT_LANES = 8;  // Largest number of blocks a kernel decrypts side by side
+    static const int DECRYPT_LANES = 4;      // Blocks decrypted side by side by the portable interleaved kernels
+
+    // Kernels specialized for one protocol number
+    typedef struct {
+        const char *name;
+        int lanes;  // Number of messages decrypt_lanes accepts
+        void (*keysched)(uint64_t key, uint32_t kext[ 16 ]);
+        void (*encrypt)(uint8_t *out, const uint8_t *in, uint32_t len, const uint32_t *kext);
+        void (*decrypt)(uint8_t *out, const uint8_t *in, uint32_t len, const uint32_t *kext);
+        uint32_t (*digest)(uint64_t key, const uint8_t *in, uint32_t len);
+        bool (*decrypt_and_verify)(uint8_t *out, const uint8_t *in, uint32_t len, const KeyContext &kc,
+                                   const uint8_t *prefix, uint32_t prefixLen, uint32_t *calcValue);
+        void (*decrypt_lanes)(const DecryptJob *const job[], int n);
+    } KERNEL_t;
+
+    // Kernels for protocols 0x00 and 0x04 built for an instruction set extension (NULL if not built for this CPU architecture)
+    const KERNEL_t *kernels_sse2(void);
+    const KERNEL_t *kernels_avx2(void);
+    const KERNEL_t *kernels_neon(void);
+
+    // Everything below is compiled again by each instruction set translation unit
+    // The unnamed namespace keeps those copies apart, so code built for AVX2 never replaces the portable one at link time
+    namespace {
+
+    //------------------------------------------------------------------------------
+    static inline uint64_t reverse64(uint64_t x)
+    {
+        x = ((x & 0xff00ff00ff00ff00LL) >>  8) | ((x & 0x00ff00ff00ff00ffLL) <<  8);
+        x = ((x & 0xffff0000ffff0000LL) >> 16) | ((x & 0x0000ffff0000ffffLL) << 16);
+        return (x >> 32) | (x << 32);
+    }
+
+    //------------------------------------------------------------------------------
+    static inline uint32_t reverse32(uint32_t x)
+    {
+        x = ((x & 0xff00ff00) >>  8) | ((x & 0x00ff00ff) <<  8);
+        return (x >> 16) | (x << 16);
+    }
+
+    //------------------------------------------------------------------------------
+    static inline int bitcount(uint32_t x)
+    {
+        x = (x & 0x55555555) + ((x & 0xaaaaaaaa) >> 1);
+        x = (x & 0x33333333) + ((x & 0xcccccccc) >> 2);
+        x = (x & 0x0f0f0f0f) + ((x & 0xf0f0f0f0) >> 4);
+        x = (x & 0x00ff00ff) + ((x & 0xff00ff00) >> 8);
+        x = (x & 0x0000ffff) + ((x & 0xffff0000) >> 16);
+        return x;
+    }
+
+    //------------------------------------------------------------------------------
+    static inline int parity(uint32_t x)
+    {
+        x ^= x >> 16;
+        x ^= x >> 8;
+        x ^= x >> 4;
+        x ^= x >> 2;
+        x ^= x >> 1;
+        return x & 1;
+    }
+
+    //------------------------------------------------------------------------------
+    static constexpr uint8_t SBOX40[ 256 ] = {
+        0xAA, 0xA2, 0x10, 0xFA, 0xA9, 0xF0, 0x40, 0x2F, 0xB1, 0x1C, 0x1A, 0x6F, 0x43, 0xB4, 0x73, 0xBC,
+        0x69, 0x77, 0xC5, 0x00, 0xF3, 0xD4, 0x09, 0x7E, 0x58, 0x8D, 0x44, 0xC3, 0xF5, 0x54, 0x0C, 0xDD,
+        0x3F, 0xB7, 0xD1, 0xD6, 0x9A, 0xD3, 0x39, 0x82, 0x01, 0x5E, 0x03, 0xED, 0x78, 0x63, 0x90, 0x49,
+        0x9B, 0x15, 0xA8, 0x4F, 0x67, 0x52, 0xAC, 0xE4, 0x37, 0xEA, 0xF7, 0x23, 0x55, 0x0F, 0x42, 0x12,
+        0xE3, 0x05, 0x5F, 0x2D, 0x2E, 0x7F, 0x11, 0x38, 0x07, 0xF4, 0x3C, 0xE2, 0xD5, 0x9F, 0xDF, 0xCF,
+        0x30, 0x0B, 0xAD, 0x66, 0x22, 0x70, 0xEF, 0x7B, 0xA6, 0x24, 0x65, 0x0D, 0x5D, 0x79, 0x02, 0x4D,
+        0x0E, 0x32, 0x84, 0x97, 0xB8, 0x57, 0x34, 0xE8, 0x41, 0x87, 0xC1, 0xF9, 0x9C, 0x56, 0xAE, 0x71,
+        0xAB, 0xBF, 0xD0, 0x88, 0x25, 0xC8, 0x1F, 0xD7, 0xFE, 0x04, 0x4E, 0xCE, 0x51, 0x81, 0xBB, 0xCD,
+        0x91, 0xA5, 0x14, 0x75, 0xA4, 0x60, 0x61, 0x6E, 0x7A, 0xE6, 0x99, 0xD8, 0xA0, 0x4C, 0xDC, 0x1B,
+        0x06, 0x6C, 0x3E, 0x9E, 0xF8, 0xCB, 0x98, 0x92, 0x0A, 0xFB, 0x2A, 0xCA, 0x50, 0x7C, 0xC0, 0x83,
+        0x94, 0xB5, 0x6A, 0x21, 0x95, 0xB3, 0x48, 0xD9, 0x16, 0xA7, 0xEE, 0x4B, 0xFD, 0x9D, 0xBD, 0x6B,
+        0xC6, 0x80, 0x20, 0x3A, 0x53, 0x1E, 0x5C, 0xC7, 0xB6, 0x08, 0xAF, 0xA1, 0x2B, 0x19, 0x26, 0x8A,
+        0x47, 0xE1, 0x86, 0x74, 0xE9, 0x59, 0x62, 0x8B, 0x28, 0x6D, 0xEC, 0x76, 0xB0, 0x45, 0xC2, 0x46,
+        0x4A, 0xE0, 0xF2, 0x8C, 0xBE, 0x3B, 0x5B, 0xBA, 0x31, 0x96, 0xE5, 0x36, 0x8E, 0xEB, 0xE7, 0xB9,
+        0xA3, 0x35, 0x17, 0x68, 0x27, 0x8F, 0x85, 0x89, 0x29, 0x93, 0xFF, 0xFC, 0xDE, 0x7D, 0x18, 0xDB,
+        0x64, 0xF6, 0x1D, 0xB2, 0x3D, 0xF1, 0xC9, 0x13, 0xDA, 0xCC, 0xC4, 0x72, 0x33, 0x5A, 0xD2, 0x2C
+    };
+
+    //------------------------------------------------------------------------------
+    static uint32_t sbox40(uint32_t x)
+    {
+        return ((SBOX40[ 0xff & (x >> 24) ] << 24) |
+                (SBOX40[ 0xff & (x >> 16) ] << 16) |
+                (SBOX40[ 0xff & (x >>  8) ] <<  8) |
+                (SBOX40[ 0xff & (x) ]));
+    }
+
+    //------------------------------------------------------------------------------
+    // Linear part of round40 (every step is a shift, rotation or XOR)
+    static constexpr uint32_t linear40(uint32_t x)
+    {
+        x ^= ((x & 0x007f007f) <<  9) | ((x & 0x00800080) <<  1);
+        x ^= ((x & 0x7f007f00) >>  7) | ((x & 0x80008000) >> 15);
+        x  = (x << 8) | (x >> 24);
+        x ^= ((x & 0x3f003f00) >>  6) | ((x & 0xc000c000) >> 14);
+        x ^= ((x & 0x003f003f) << 10) | ((x & 0x00c000c0) <<  2);
+        x  = (x >> 8) | (x << 24);
+        return x;
+    }
+
+    //------------------------------------------------------------------------------
+    // T-tables of round40: t[ i ][ b ] = linear40(sbox of byte i = b)
+    // linear40 distributes over XOR, so a round is the XOR of one lookup per input byte
+    struct Round40Table {
+        uint32_t t[ 4 ][ 256 ];
+    };
+
+    static constexpr Round40Table make_round40_table(void)
+    {
+        Round40Table table = {};
+        for (int i = 0; i < 4; i++) {
+            for (int b = 0; b < 256; b++) {
+                table.t[ i ][ b ] = linear40((uint32_t)SBOX40[ b ] << (8 * i));
+            }
+        }
+        return table;
+    }
+
+    static constexpr Round40Table ROUND40 = make_round40_table();
+
+    //------------------------------------------------------------------------------
+    // Constants of a protocol number
+    // Protocol numbers only differ by bit 0x40 and by whether any of bits 0x0c is set,
+    // so the kernels below are instantiated for 0x00, 0x04, 0x40 and 0x44
+    template <uint8_t PROTOCOL>
+    struct Protocol {
+        static constexpr bool is40 = (PROTOCOL & 0x40) != 0;
+        static constexpr uint64_t salt = (PROTOCOL & 0x0c) ? 0xfbe852461acd3970LL : 0xd34c027be8579632LL;
+        static constexpr uint32_t keyChain = (PROTOCOL & 0x0c) ? 0x84e5c4e7 : 0x6aa32b6f;
+        static constexpr uint64_t iv = is40 ? 0x11096919991927feLL : 0xfe27199919690911LL;
+    };
+
+    //------------------------------------------------------------------------------
+    template <uint8_t FLAVOR>
+    static inline uint32_t round00(uint32_t x, uint32_t k)
+    {
+        const uint16_t salt = (FLAVOR & 2) ? 0x5353 : 0;
+        x = (0xffff & (x + k + salt)) | ((x >> 16) + (k >> 16) + salt) << 16;
+        x = ((x & 0xf0f0f0f0) >> 4) | ((x & 0x0f0f0f0f) << 4);
+        k = (k << 1) | (k >> 31);
+        x = (parity(x & k)) ? x ^ ~k : x;
+        x = (FLAVOR & 1) ?
+            (x & 0xaa55aa55) | ((x & 0x55005500) >> 7) | ((x & 0x00aa00aa) << 7):
+            (x & 0x55aa55aa) | ((x & 0xaa00aa00) >> 9) | ((x & 0x00550055) << 9);
+        x = (x & 0x00ffff00) | (x >> 24) | (x << 24);
+        x = x ^ ((x << 24) | (x >> 8)) ^ ((x << 25) | (x >> 7));
+
+        return x;
+    }
+
+    //------------------------------------------------------------------------------
+    static inline uint32_t round40(uint32_t x, uint32_t k)
+    {
+        x ^= k;
+        return ROUND40.t[ 0 ][ 0xff & (x) ] ^
+               ROUND40.t[ 1 ][ 0xff & (x >>  8) ] ^
+               ROUND40.t[ 2 ][ 0xff & (x >> 16) ] ^
+               ROUND40.t[ 3 ][ 0xff & (x >> 24) ];
+    }
+
+    //------------------------------------------------------------------------------
+    static constexpr uint8_t flavor[ 8 ][ 16 ] = {
+        { 1, 0, 1, 2, 2, 2, 0, 2, 1, 3, 0, 2, 1, 0, 0, 1 },
+        { 3, 2, 0, 2, 2, 0, 3, 0, 3, 1, 3, 3, 0, 1, 0, 1 },
+        { 2, 0, 0, 1, 1, 3, 3, 1, 0, 1, 2, 0, 1, 0, 1, 0 },
+        { 2, 3, 0, 1, 0, 0, 3, 1, 3, 1, 1, 3, 1, 0, 0, 2 },
+        { 2, 3, 3, 2, 1, 3, 1, 2, 1, 2, 3, 1, 2, 0, 0, 1 },
+        { 2, 2, 3, 3, 1, 3, 2, 2, 3, 1, 0, 2, 0, 0, 1, 1 },
+        { 1, 3, 1, 2, 2, 0, 1, 0, 3, 3, 3, 1, 0, 2, 2, 2 },
+        { 1, 2, 0, 2, 0, 0, 3, 1, 1, 3, 1, 2, 2, 2, 0, 1 }
+    };
+
+    //------------------------------------------------------------------------------
+    // Feistel rounds of N blocks processed side by side, unrolled at compile time
+    // Each step runs two rounds: encryption goes through rounds R, R + 1 ... 15, decryption through 15 - R, 14 - R ... 0
+    // Each block is a serial chain of 16 rounds, so running several side by side keeps the CPU busy while one waits
+    template <int N, int R>
+    struct Rounds00 {
+        static inline void encrypt(uint32_t left[ N ], uint32_t right[ N ], const uint32_t *const kext[ N ])
+        {
+            for (int i = 0; i < N; i++) left[ i ]  ^= round00<flavor[ 0 ][ R ]>(right[ i ], kext[ i ][ R & 3 ]);
+            for (int i = 0; i < N; i++) right[ i ] ^= round00<flavor[ 0 ][ R + 1 ]>(left[ i ], kext[ i ][ (R + 1) & 3 ]);
+            Rounds00<N, R + 2>::encrypt(left, right, kext);
+        }
+
+        static inline void decrypt(uint32_t left[ N ], uint32_t right[ N ], const uint32_t *const kext[ N ])
+        {
+            for (int i = 0; i < N; i++) left[ i ]  ^= round00<flavor[ 0 ][ 15 - R ]>(right[ i ], kext[ i ][ (15 - R) & 3 ]);
+            for (int i = 0; i < N; i++) right[ i ] ^= round00<flavor[ 0 ][ 14 - R ]>(left[ i ], kext[ i ][ (14 - R) & 3 ]);
+            Rounds00<N, R + 2>::decrypt(left, right, kext);
+        }
+    };
+
+    template <int N>
+    struct Rounds00<N, 16> {
+        static inline void encrypt(uint32_t *, uint32_t *, const uint32_t *const *) {}
+        static inline void decrypt(uint32_t *, uint32_t *, const uint32_t *const *) {}
+    };
+
+    template <int N, int R>
+    struct Rounds40 {
+        static inline void encrypt(uint32_t left[ N ], uint32_t right[ N ], const uint32_t *const kext[ N ])
+        {
+            for (int i = 0; i < N; i++) right[ i ] ^= round40(left[ i ], kext[ i ][ R ]);
+            for (int i = 0; i < N; i++) left[ i ]  ^= round40(right[ i ], kext[ i ][ R + 1 ]);
+            Rounds40<N, R + 2>::encrypt(left, right, kext);
+        }
+
+        static inline void decrypt(uint32_t left[ N ], uint32_t right[ N ], const uint32_t *const kext[ N ])
+        {
+            for (int i = 0; i < N; i++) right[ i ] ^= round40(left[ i ], kext[ i ][ 15 - R ]);
+            for (int i = 0; i < N; i++) left[ i ]  ^= round40(right[ i ], kext[ i ][ 14 - R ]);
+            Rounds40<N, R + 2>::decrypt(left, right, kext);
+        }
+    };
+
+    template <int N>
+    struct Rounds40<N, 16> {
+        static inline void encrypt(uint32_t *, uint32_t *, const uint32_t *const *) {}
+        static inline void decrypt(uint32_t *, uint32_t *, const uint32_t *const *) {}
+    };
+
+    //------------------------------------------------------------------------------
+    // Encrypt or decrypt N independent blocks (each with its own expanded key)
+    template <uint8_t PROTOCOL, bool ENCRYPT, int N>
+    static inline void cipher_blocks(uint64_t block[ N ], const uint32_t *const kext[ N ])
+    {
+        uint32_t left[ N ], right[ N ];
+        for (int i = 0; i < N; i++) {
+            uint64_t b = Protocol<PROTOCOL>::is40 ? block[ i ] + Protocol<PROTOCOL>::salt : block[ i ];
+            left[ i ] = (uint32_t)(b >> 32);
+            right[ i ] = (uint32_t)b;
+        }
+        if (Protocol<PROTOCOL>::is40) {
+            if (ENCRYPT) {
+                Rounds40<N, 0>::encrypt(left, right, kext);
+            } else {
+                Rounds40<N, 0>::decrypt(left, right, kext);
+            }
+        } else {
+            if (ENCRYPT) {
+                Rounds00<N, 0>::encrypt(left, right, kext);
+            } else {
+                Rounds00<N, 0>::decrypt(left, right, kext);
+            }
+        }
+        for (int i = 0; i < N; i++) {
+            uint64_t b = ((uint64_t)right[ i ] << 32) | left[ i ];
+            block[ i ] = Protocol<PROTOCOL>::is40 ? b - Protocol<PROTOCOL>::salt : b;
+        }
+    }
+
+    //------------------------------------------------------------------------------
+    // Protocol 0x40/0x44 processes blocks as little-endian values, protocol 0x00/0x04 as big-endian ones
+    template <uint8_t PROTOCOL>
+    static inline uint64_t load_block(const uint8_t *p, int n = 8)
+    {
+        return Protocol<PROTOCOL>::is40 ? ld_le64(p, n) : ld_be64(p, n);
+    }
+
+    template <uint8_t PROTOCOL>
+    static inline void store_block(uint8_t *p, uint64_t x, int n = 8)
+    {
+        if (Protocol<PROTOCOL>::is40) {
+            st_le64(p, x, n);
+        } else {
+            st_be64(p, x, n);
+        }
+    }
+
+    //------------------------------------------------------------------------------
+    // Process the final partial block (XORed with the encrypted chain value, the same for both directions)
+    template <uint8_t PROTOCOL>
+    static inline void cipher_tail(uint8_t *out, const uint8_t *in, uint32_t len, const uint32_t *kext, uint64_t chain)
+    {
+        uint64_t block[ 1 ] = { chain };
+        const uint32_t *lanes[ 1 ] = { kext };
+        cipher_blocks<PROTOCOL, true, 1>(block, lanes);
+        store_block<PROTOCOL>(out, load_block<PROTOCOL>(in, len) ^ block[ 0 ], len);
+    }
+
+    //------------------------------------------------------------------------------
+    template <uint8_t PROTOCOL>
+    static void keysched(uint64_t key, uint32_t kext[ 16 ])
+    {
+        if (!Protocol<PROTOCOL>::is40) {
+            kext[ 0 ] = (uint32_t)(key >> 32);
+            kext[ 1 ] = (uint32_t)key;
+            kext[ 2 ] = 0x08090a0b;
+            kext[ 3 ] = 0x0c0d0e0f;
+
+            uint32_t chain = Protocol<PROTOCOL>::keyChain;
+            for (int i = 0; i < 8; i++) {
+                kext[ i & 3 ] = chain = round00<0>(kext[ i & 3 ], chain);
+            }
+            return;
+        }
+
+        // key ~ 01234567; left ~ 6420; right ~ 7531;
+        key = ((key & 0x00ffff0000ffff00LL) |
+                (key & 0xff000000ff000000LL) >> 24 |
+                (key & 0x000000ff000000ffLL) << 24);
+        key = ((key & 0x0000ffffffff0000LL) |
+                (key & 0xffff000000000000LL) >> 48 |
+                (key & 0x000000000000ffffLL) << 48);
+
+        uint32_t left  = (uint32_t)(key >> 32);
+        uint32_t right = (uint32_t)key;
+
+        for (int i = 0; i < 16 ; i++) {
+            uint32_t s = sbox40(right);
+            s = ((0x00ffff00 & (s ^ left)) |
+                (0xff0000ff & ((s & 0xff0000ff) + (left & 0xff0000ff))));
+            left  = right;
+            right = (s >> 8) | (s << 24);
+            kext[ i ] = s;
+        }
+    }
+
+    //------------------------------------------------------------------------------
+    // Incremental digest: gives the same value over the concatenation of all updates as over the whole input
+    // The total length must be given in advance (protocol 0x40/0x44 mixes it into the key)
+    typedef struct {
+        uint64_t key;
+        uint64_t mac;
+        uint8_t buf[ 8 ];
+        uint32_t fill;
+    } DIGEST_t;
+
+    //------------------------------------------------------------------------------
+    template <uint8_t PROTOCOL>
+    static inline void digest_begin(DIGEST_t *d, uint64_t key, uint32_t len)
+    {
+        d->fill = 0;
+        if (Protocol<PROTOCOL>::is40) {
+            d->key = reverse64(key) + ((uint64_t)((len + 7) / 8 * 2 + 2) << 32);
+            uint32_t mac = (uint32_t)Protocol<PROTOCOL>::salt;
+            d->mac = mac + round40((uint32_t)d->key, mac);
+        } else {
+            d->key = key;
+            d->mac = 0;
+        }
+    }
+
+    //------------------------------------------------------------------------------
+    template <uint8_t PROTOCOL>
+    static inline void digest_block(DIGEST_t *d, const uint8_t *in, int n)
+    {
+        uint64_t text = load_block<PROTOCOL>(in, n);
+        if (Protocol<PROTOCOL>::is40) {
+            uint32_t mac = (uint32_t)d->mac;
+            mac += round40((uint32_t)text, mac);
+            mac += round40((uint32_t)(text >> 32), mac);
+            d->mac = mac;
+        } else {
+            uint64_t mac = d->mac ^ text;
+            mac ^= (uint64_t)round00<3>((uint32_t)mac, (uint32_t)(d->key >> 32)) << 32;
+            mac ^= (uint64_t)round00<3>((uint32_t)(mac >> 32), (uint32_t)d->key);
+            d->mac = mac;
+        }
+    }
+
+    //------------------------------------------------------------------------------
+    template <uint8_t PROTOCOL>
+    static inline void digest_update(DIGEST_t *d, const uint8_t *in, uint32_t len)
+    {
+        if (d->fill) {
+            while (len && (d->fill < 8)) {
+                d->buf[ d->fill++ ] = *in++;
+                len--;
+            }
+            if (d->fill < 8) return;
+            digest_block<PROTOCOL>(d, d->buf, 8);
+            d->fill = 0;
+        }
+        while (len >= 8) {
+            digest_block<PROTOCOL>(d, in, 8);
+            in += 8; len -= 8;
+        }
+        while (len--) d->buf[ d->fill++ ] = *in++;
+    }
+
+    //------------------------------------------------------------------------------
+    template <uint8_t PROTOCOL>
+    static inline uint32_t digest_end(DIGEST_t *d)
+    {
+        if (d->fill) digest_block<PROTOCOL>(d, d->buf, d->fill);
+        if (Protocol<PROTOCOL>::is40) {
+            uint32_t mac = (uint32_t)d->mac;
+            mac += round40((uint32_t)((Protocol<PROTOCOL>::salt >> 32) + (d->key >> 32)), mac);
+            return reverse32(mac);
+        }
+        return (uint32_t)d->mac;
+    }
+
+    //------------------------------------------------------------------------------
+    template <uint8_t PROTOCOL>
+    static uint32_t digest_kernel(uint64_t key, const uint8_t *in, uint32_t len)
+    {
+        DIGEST_t d;
+        digest_begin<PROTOCOL>(&d, key, len);
+        digest_update<PROTOCOL>(&d, in, len);
+        return digest_end<PROTOCOL>(&d);
+    }
+
+    //------------------------------------------------------------------------------
+    // Block decryption engines: decrypt LANES independent blocks, each with its own expanded key
+    template <uint8_t PROTOCOL, int N>
+    struct ScalarEngine {
+        static const int LANES = N;
+
+        static inline void decrypt(uint64_t block[ N ], const uint32_t *const kext[ N ])
+        {
+            cipher_blocks<PROTOCOL, false, N>(block, kext);
+        }
+    };
+
+    //------------------------------------------------------------------------------
+    // round00 on every lane of a SIMD register
+    // VEC wraps one instruction set: V, LANES, set1, load, store, add16, sub32, band, bor, bxor, bandnot (~a & b), shl<S>, shr<S>
+    template <class VEC, uint8_t FLAVOR>
+    static inline typename VEC::V vround00(typename VEC::V x, typename VEC::V k)
+    {
+        typedef typename VEC::V V;
+        x = VEC::add16(x, k);
+        if (FLAVOR & 2) x = VEC::add16(x, VEC::set1(0x53535353));
+        x = VEC::bor(VEC::template shr<4>(VEC::band(x, VEC::set1(0xf0f0f0f0))),
+                     VEC::template shl<4>(VEC::band(x, VEC::set1(0x0f0f0f0f))));
+        k = VEC::bor(VEC::template shl<1>(k), VEC::template shr<31>(k));
+        V p = VEC::band(x, k);
+        p = VEC::bxor(p, VEC::template shr<16>(p));
+        p = VEC::bxor(p, VEC::template shr<8>(p));
+        p = VEC::bxor(p, VEC::template shr<4>(p));
+        p = VEC::bxor(p, VEC::template shr<2>(p));
+        p = VEC::bxor(p, VEC::template shr<1>(p));
+        p = VEC::sub32(VEC::set1(0), VEC::band(p, VEC::set1(1)));
+        x = VEC::bxor(x, VEC::bandnot(k, p));
+        if (FLAVOR & 1) {
+            x = VEC::bor(VEC::band(x, VEC::set1(0xaa55aa55)),
+                         VEC::bor(VEC::template shr<7>(VEC::band(x, VEC::set1(0x55005500))),
+                                  VEC::template shl<7>(VEC::band(x, VEC::set1(0x00aa00aa)))));
+        } else {
+            x = VEC::bor(VEC::band(x, VEC::set1(0x55aa55aa)),
+                         VEC::bor(VEC::template shr<9>(VEC::band(x, VEC::set1(0xaa00aa00))),
+                                  VEC::template shl<9>(VEC::band(x, VEC::set1(0x00550055)))));
+        }
+        x = VEC::bor(VEC::band(x, VEC::set1(0x00ffff00)), VEC::bor(VEC::template shr<24>(x), VEC::template shl<24>(x)));
+        x = VEC::bxor(x, VEC::bxor(VEC::bor(VEC::template shl<24>(x), VEC::template shr<8>(x)),
+                                   VEC::bor(VEC::template shl<25>(x), VEC::template shr<7>(x))));
+        return x;
+    }
+
+    template <class VEC, int R>
+    struct VecRounds00 {
+        typedef typename VEC::V V;
+
+        static inline void decrypt(V &left, V &right, const V kext[ 4 ])
+        {
+            left  = VEC::bxor(left,  vround00<VEC, flavor[ 0 ][ 15 - R ]>(right, kext[ (15 - R) & 3 ]));
+            right = VEC::bxor(right, vround00<VEC, flavor[ 0 ][ 14 - R ]>(left,  kext[ (14 - R) & 3 ]));
+            VecRounds00<VEC, R + 2>::decrypt(left, right, kext);
+        }
+    };
+
+    template <class VEC>
+    struct VecRounds00<VEC, 16> {
+        static inline void decrypt(typename VEC::V &, typename VEC::V &, const typename VEC::V *) {}
+    };
+
+    //------------------------------------------------------------------------------
+    // Protocol 0x00/0x04 decryption with one block per SIMD lane
+    // (protocol 0x40/0x44 is table lookups, which SIMD registers cannot do faster than the scalar T-tables)
+    template <class VEC>
+    struct VectorEngine00 {
+        static const int LANES = VEC::LANES;
+
+        static inline void decrypt(uint64_t block[ LANES ], const uint32_t *const kext[ LANES ])
+        {
+            typedef typename VEC::V V;
+            uint32_t left[ LANES ], right[ LANES ], key[ 4 ][ LANES ];
+            for (int i = 0; i < LANES; i++) {
+                left[ i ] = (uint32_t)(block[ i ] >> 32);
+                right[ i ] = (uint32_t)block[ i ];
+                for (int j = 0; j < 4; j++) key[ j ][ i ] = kext[ i ][ j ];
+            }
+            V l = VEC::load(left), r = VEC::load(right);
+            V k[ 4 ] = { VEC::load(key[ 0 ]), VEC::load(key[ 1 ]), VEC::load(key[ 2 ]), VEC::load(key[ 3 ]) };
+            VecRounds00<VEC, 0>::decrypt(l, r, k);
+            VEC::store(left, l);
+            VEC::store(right, r);
+            for (int i = 0; i < LANES; i++) block[ i ] = ((uint64_t)right[ i ] << 32) | left[ i ];
+        }
+    };
+
+    //------------------------------------------------------------------------------
+    // Decrypt ENGINE::LANES consecutive CBC blocks at once (CBC decryption has no dependency between blocks)
+    // Returns the chain value for the next block
+    template <uint8_t PROTOCOL, class ENGINE>
+    static inline uint64_t decrypt_blocks(uint8_t *out, const uint8_t *in, const uint32_t *kext, uint64_t chain)
+    {
+        const uint32_t *lanes[ ENGINE::LANES ];
+        uint64_t block[ ENGINE::LANES ];
+        for (int i = 0; i < ENGINE::LANES; i++) {
+            lanes[ i ] = kext;
+            block[ i ] = load_block<PROTOCOL>(in + 8 * i);
+        }
+        ENGINE::decrypt(block, lanes);
+        for (int i = 0; i < ENGINE::LANES; i++) {
+            uint64_t crypt = load_block<PROTOCOL>(in + 8 * i);
+            store_block<PROTOCOL>(out + 8 * i, block[ i ] ^ chain);
+            chain = crypt;
+        }
+        return chain;
+    }
+
+    //------------------------------------------------------------------------------
+    // Blocks left over by an engine wider than DECRYPT_LANES are still decrypted DECRYPT_LANES at a time
+    template <uint8_t PROTOCOL, class ENGINE>
+    struct RestEngine {
+        typedef ScalarEngine<PROTOCOL, (ENGINE::LANES > DECRYPT_LANES) ? DECRYPT_LANES : 1> type;
+    };
+
+    //------------------------------------------------------------------------------
+    template <uint8_t PROTOCOL>
+    static void encrypt_kernel(uint8_t *out, const uint8_t *in, uint32_t len, const uint32_t *kext)
+    {
+        const uint32_t *lanes[ 1 ] = { kext };
+        uint64_t chain = Protocol<PROTOCOL>::iv;
+        while (len >= 8) {
+            uint64_t block[ 1 ] = { load_block<PROTOCOL>(in) ^ chain };
+            cipher_blocks<PROTOCOL, true, 1>(block, lanes);
+            store_block<PROTOCOL>(out, block[ 0 ]);
+            chain = block[ 0 ];
+            in += 8; out += 8; len -= 8;
+        }
+        if (len > 0) {
+            cipher_tail<PROTOCOL>(out, in, len, kext, chain);
+        }
+    }
+
+    //------------------------------------------------------------------------------
+    template <uint8_t PROTOCOL, class ENGINE>
+    static void decrypt_kernel(uint8_t *out, const uint8_t *in, uint32_t len, const uint32_t *kext)
+    {
+        uint64_t chain = Protocol<PROTOCOL>::iv;
+        while (len >= 8 * ENGINE::LANES) {
+            chain = decrypt_blocks<PROTOCOL, ENGINE>(out, in, kext, chain);
+            in += 8 * ENGINE::LANES; out += 8 * ENGINE::LANES; len -= 8 * ENGINE::LANES;
+        }
+        typedef typename RestEngine<PROTOCOL, ENGINE>::type REST;
+        while (len >= 8 * REST::LANES) {
+            chain = decrypt_blocks<PROTOCOL, REST>(out, in, kext, chain);
+            in += 8 * REST::LANES; out += 8 * REST::LANES; len -= 8 * REST::LANES;
+        }
+        while (len >= 8) {
+            chain = decrypt_blocks<PROTOCOL, ScalarEngine<PROTOCOL, 1> >(out, in, kext, chain);
+            in += 8; out += 8; len -= 8;
+        }
+        if (len > 0) {
+            cipher_tail<PROTOCOL>(out, in, len, kext, chain);
+        }
+    }
+
+    //------------------------------------------------------------------------------
+    template <uint8_t PROTOCOL, class ENGINE>
+    static bool decrypt_and_verify_kernel(uint8_t *out, const uint8_t *in, uint32_t len, const KeyContext &kc,
+                                          const uint8_t *prefix, uint32_t prefixLen, uint32_t *calcValue)
+    {
+        if (len < 4) {
+            decrypt_kernel<PROTOCOL, ENGINE>(out, in, len, kc.kext);
+            *calcValue = digest_kernel<PROTOCOL>(kc.key, prefix, prefixLen);
+            return false;
+        }
+
+        // Each plaintext block is fed to the digest right after it is produced (the code itself is not covered)
+        const uint32_t step = 8 * ENGINE::LANES;
+        uint32_t macLen = len - 4;
+        DIGEST_t d;
+        digest_begin<PROTOCOL>(&d, kc.key, prefixLen + macLen);
+        digest_update<PROTOCOL>(&d, prefix, prefixLen);
+
+        uint64_t chain = Protocol<PROTOCOL>::iv;
+        uint32_t pos = 0;
+        while (len - pos >= step) {
+            chain = decrypt_blocks<PROTOCOL, ENGINE>(out + pos, in + pos, kc.kext, chain);
+            if (pos < macLen) digest_update<PROTOCOL>(&d, out + pos, (macLen - pos < step) ? macLen - pos : step);
+            pos += step;
+        }
+        typedef typename RestEngine<PROTOCOL, ENGINE>::type REST;
+        while (len - pos >= 8 * REST::LANES) {
+            chain = decrypt_blocks<PROTOCOL, REST>(out + pos, in + pos, kc.kext, chain);
+            if (pos < macLen) digest_update<PROTOCOL>(&d, out + pos, (macLen - pos < 8 * REST::LANES) ? macLen - pos : 8 * REST::LANES);
+            pos += 8 * REST::LANES;
+        }
+        while (len - pos >= 8) {
+            chain = decrypt_blocks<PROTOCOL, ScalarEngine<PROTOCOL, 1> >(out + pos, in + pos, kc.kext, chain);
+            if (pos < macLen) digest_update<PROTOCOL>(&d, out + pos, (macLen - pos < 8) ? macLen - pos : 8);
+            pos += 8;
+        }
+        if (pos < len) {
+            cipher_tail<PROTOCOL>(out + pos, in + pos, len - pos, kc.kext, chain);
+            if (pos < macLen) digest_update<PROTOCOL>(&d, out + pos, macLen - pos);
+        }
+
+        *calcValue = digest_end<PROTOCOL>(&d);
+        return *calcValue == ld_be32(out + macLen);
+    }
+
+    //------------------------------------------------------------------------------
+    // Decrypt up to ENGINE::LANES messages of the same protocol, one lane per message
+    template <uint8_t PROTOCOL, class ENGINE>
+    static void decrypt_lanes_kernel(const DecryptJob *const job[], int n)
+    {
+        const int LANES = ENGINE::LANES;
+        const uint32_t *kext[ LANES ];
+        uint64_t chain[ LANES ];
+        uint32_t blocks[ LANES ];
+        uint32_t maxBlocks = 0;
+
+        // Unused lanes repeat the first job on zero blocks and their results are discarded
+        for (int i = 0; i < LANES; i++) {
+            const DecryptJob *j = job[ (i < n) ? i : 0 ];
+            kext[ i ] = j->kc->kext;
+            chain[ i ] = Protocol<PROTOCOL>::iv;
+            blocks[ i ] = (i < n) ? (j->len / 8) : 0;
+            if (blocks[ i ] > maxBlocks) maxBlocks = blocks[ i ];
+        }
+
+        for (uint32_t b = 0; b < maxBlocks; b++) {
+            uint64_t crypt[ LANES ], block[ LANES ];
+            for (int i = 0; i < LANES; i++) {
+                crypt[ i ] = (b >= blocks[ i ]) ? 0 : load_block<PROTOCOL>(job[ i ]->in + b * 8);
+                block[ i ] = crypt[ i ];
+            }
+
+            ENGINE::decrypt(block, kext);
+
+            for (int i = 0; i < LANES; i++) {
+                if (b >= blocks[ i ]) continue;
+                store_block<PROTOCOL>(job[ i ]->out + b * 8, block[ i ] ^ chain[ i ]);
+                chain[ i ] = crypt[ i ];
+            }
+        }
+
+        for (int i = 0; i < n; i++) {
+            uint32_t pos = blocks[ i ] * 8;
+            if (pos < job[ i ]->len) cipher_tail<PROTOCOL>(job[ i ]->out + pos, job[ i ]->in + pos, job[ i ]->len - pos, kext[ i ], chain[ i ]);
+        }
+    }
+
+    //------------------------------------------------------------------------------
+    template <uint8_t PROTOCOL, class ENGINE>
+    static constexpr KERNEL_t make_kernel(const char *name)
+    {
+        return {
+            name,
+            ENGINE::LANES,
+            keysched<PROTOCOL>,
+            encrypt_kernel<PROTOCOL>,
+            decrypt_kernel<PROTOCOL, ENGINE>,
+            digest_kernel<PROTOCOL>,
+            decrypt_and_verify_kernel<PROTOCOL, ENGINE>,
+            decrypt_lanes_kernel<PROTOCOL, ENGINE>
+        };
+    }
+
+    }  // namespace
+}
@@ -0,0 +1,52 @@
+#include "crypto_kernel.h"
+
+// Protocol 0x00/0x04 kernels with four blocks in the 32-bit lanes of a NEON register
+// (built with NEON enabled; only selected when the CPU supports it)
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__) || defined(_M_ARM64)
+#include <arm_neon.h>
+
+namespace Crypto {
+
+    namespace {
+        struct VecNEON {
+            typedef uint32x4_t V;
+            static const int LANES = 4;
+
+            static inline V set1(uint32_t x) { return vdupq_n_u32(x); }
+            static inline V load(const uint32_t *p) { return vld1q_u32(p); }
+            static inline void store(uint32_t *p, V x) { vst1q_u32(p, x); }
+            static inline V add16(V a, V b) { return vreinterpretq_u32_u16(vaddq_u16(vreinterpretq_u16_u32(a), vreinterpretq_u16_u32(b))); }
+            static inline V sub32(V a, V b) { return vsubq_u32(a, b); }
+            static inline V band(V a, V b) { return vandq_u32(a, b); }
+            static inline V bor(V a, V b) { return vorrq_u32(a, b); }
+            static inline V bxor(V a, V b) { return veorq_u32(a, b); }
+            static inline V bandnot(V a, V b) { return vbicq_u32(b, a); }
+            template <int S> static inline V shl(V x) { return vshlq_n_u32(x, S); }
+            template <int S> static inline V shr(V x) { return vshrq_n_u32(x, S); }
+        };
+    }
+
+    //==============================================================================
+    const KERNEL_t *kernels_neon(void)
+    {
+        static constexpr KERNEL_t kernels[ 2 ] = {
+            make_kernel<0x00, VectorEngine00<VecNEON> >("neon"),
+            make_kernel<0x04, VectorEngine00<VecNEON> >("neon")
+        };
+        return kernels;
+    }
+}
+
+#else
+
+namespace Crypto {
+
+    //==============================================================================
+    const KERNEL_t *kernels_neon(void)
+    {
+        return NULL;
+    }
+}
+
+#endif
@@ -0,0 +1,52 @@
+#include "crypto_kernel.h"
+
+// Protocol 0x00/0x04 kernels with four blocks in the 32-bit lanes of an SSE2 register
+// (built with SSE2 enabled; only selected when the CPU supports it)
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#include <emmintrin.h>
+
+namespace Crypto {
+
+    namespace {
+        struct VecSSE2 {
+            typedef __m128i V;
+            static const int LANES = 4;
+
+            static inline V set1(uint32_t x) { return _mm_set1_epi32((int)x); }
+            static inline V load(const uint32_t *p) { return _mm_loadu_si128((const __m128i *)p); }
+            static inline void store(uint32_t *p, V x) { _mm_storeu_si128((__m128i *)p, x); }
+            static inline V add16(V a, V b) { return _mm_add_epi16(a, b); }
+            static inline V sub32(V a, V b) { return _mm_sub_epi32(a, b); }
+            static inline V band(V a, V b) { return _mm_and_si128(a, b); }
+            static inline V bor(V a, V b) { return _mm_or_si128(a, b); }
+            static inline V bxor(V a, V b) { return _mm_xor_si128(a, b); }
+            static inline V bandnot(V a, V b) { return _mm_andnot_si128(a, b); }
+            template <int S> static inline V shl(V x) { return _mm_slli_epi32(x, S); }
+            template <int S> static inline V shr(V x) { return _mm_srli_epi32(x, S); }
+        };
+    }
+
+    //==============================================================================
+    const KERNEL_t *kernels_sse2(void)
+    {
+        static constexpr KERNEL_t kernels[ 2 ] = {
+            make_kernel<0x00, VectorEngine00<VecSSE2> >("sse2"),
+            make_kernel<0x04, VectorEngine00<VecSSE2> >("sse2")
+        };
+        return kernels;
+    }
+}
+
+#else
+
+namespace Crypto {
+
+    //==============================================================================
+    const KERNEL_t *kernels_sse2(void)
+    {
+        return NULL;
+    }
+}
+
+#endif
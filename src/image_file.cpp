@@ -0,0 +1,516 @@
+#include "project.h"
+#include <fstream>
+#include <iterator>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+namespace Cas {
+
+    static const uint8_t IMAGE_FILE_MAGIC[8] = { 'C', 'C', 'A', 'S', 'I', 'M', 'G', 0x01 };
+    static const uint8_t JOURNAL_MAGIC[8] = { 'C', 'C', 'A', 'S', 'J', 'N', 'L', 0x01 };
+
+    // CRC32 (IEEE 802.3), continuing from crc (0 for the first block)
+    static uint32_t calc_crc32(uint32_t crc, const uint8_t *p, size_t size)
+    {
+        crc = ~crc;
+        for (size_t i = 0; i < size; i++) {
+            crc ^= p[i];
+            for (int b = 0; b < 8; b++) crc = (crc >> 1) ^ (0xedb88320 & (0 - (crc & 1)));
+        }
+        return ~crc;
+    }
+
+    // Checksum of the generation number followed by the slot data
+    static uint32_t calc_slot_checksum(uint64_t generation, const uint8_t *data)
+    {
+        uint8_t gen[8];
+        st_be64(gen, generation);
+        return calc_crc32(calc_crc32(0, gen, sizeof(gen)), data, CARD_IMAGE_SIZE);
+    }
+
+    // Checksum of a journal record (the checksum field itself is excluded)
+    static uint32_t calc_record_checksum(const JOURNAL_RECORD_t *rec, const uint8_t *data)
+    {
+        uint32_t crc = calc_crc32(0, rec->offset, sizeof(rec->offset));
+        crc = calc_crc32(crc, rec->length, sizeof(rec->length));
+        return calc_crc32(crc, data, ld_be16(rec->length));
+    }
+
+    ImageFile::ImageFile()
+    {
+    }
+
+    ImageFile::~ImageFile()
+    {
+        close();
+    }
+
+    // Copy the current image out of the card image file
+    // Returns false if the file does not exist or neither slot holds a valid image
+    bool ImageFile::load(uint8_t *cardImage)
+    {
+        lock_guard<mutex> guard(lock);
+        if (!map(false) || !lockFile()) return false;
+        refresh();
+
+        bool result = (activeSlot >= 0);
+        if (result) {
+            memcpy(cardImage, slotData(activeSlot), CARD_IMAGE_SIZE);
+            replayJournal(cardImage);
+        }
+        unlockFile();
+        return result;
+    }
+
+    // Write the whole image as the initial one (the file is created if necessary)
+    // If another process has written an image since load() failed, that image is read into cardImage instead
+    bool ImageFile::create(uint8_t *cardImage)
+    {
+        lock_guard<mutex> guard(lock);
+        if (!map(true) || !lockFile()) return false;
+        refresh();
+
+        bool result = true;
+        if (activeSlot >= 0) {
+            memcpy(cardImage, slotData(activeSlot), CARD_IMAGE_SIZE);
+            replayJournal(cardImage);
+        } else {
+            result = saveImage(cardImage);
+        }
+        unlockFile();
+        return result;
+    }
+
+    // Append the modified ranges of the image to the journal
+    // The whole image is written instead when the journal would grow too large or cannot be used
+    bool ImageFile::saveDelta(const uint8_t *cardImage, const DirtyRanges &ranges)
+    {
+        lock_guard<mutex> guard(lock);
+        if (!map(true) || !lockFile()) return false;
+        refresh();
+
+        bool result = saveJournal(cardImage, ranges);
+        unlockFile();
+        return result;
+    }
+
+    // Append the modified ranges to the journal, or write the whole image (called with the file locked)
+    bool ImageFile::saveJournal(const uint8_t *cardImage, const DirtyRanges &ranges)
+    {
+        if ((activeSlot < 0) || compactRequired) return saveMerged(cardImage, ranges);
+
+        vector<uint8_t> records;
+        if (!journalOpen) {
+            JOURNAL_HEADER_t h;
+            memcpy(h.magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC));
+            st_be64(h.generation, generation);
+            records.insert(records.end(), (const uint8_t *)&h, (const uint8_t *)(&h + 1));
+        }
+        size_t recordsBegin = records.size();
+
+        for (int i = 0; i < ranges.count; i++) {
+            const RANGE_t *r = &ranges.range[i];
+            JOURNAL_RECORD_t rec;
+            st_be16(rec.offset, r->begin);
+            st_be16(rec.length, r->end - r->begin);
+            st_be32(rec.checksum, calc_record_checksum(&rec, cardImage + r->begin));
+            records.insert(records.end(), (const uint8_t *)&rec, (const uint8_t *)(&rec + 1));
+            records.insert(records.end(), cardImage + r->begin, cardImage + r->end);
+        }
+
+        if (sizeof(JOURNAL_HEADER_t) + journal.size() + records.size() > IMAGE_JOURNAL_MAX_SIZE) {
+            return saveMerged(cardImage, ranges);
+        }
+        if (!writeJournal(records.data(), records.size(), !journalOpen)) {
+            compactRequired = true;
+            return saveMerged(cardImage, ranges);
+        }
+
+        journal.insert(journal.end(), records.begin() + recordsBegin, records.end());
+        journalOpen = true;
+        return true;
+    }
+
+    // Write the image of the file with the modified ranges applied (called with the file locked)
+    // The rest of the caller's image is not used, since another process may have saved a newer one in the meantime
+    bool ImageFile::saveMerged(const uint8_t *cardImage, const DirtyRanges &ranges)
+    {
+        if (activeSlot < 0) return saveImage(cardImage);
+
+        uint8_t merged[CARD_IMAGE_SIZE];
+        memcpy(merged, slotData(activeSlot), CARD_IMAGE_SIZE);
+        replayJournal(merged);
+        for (int i = 0; i < ranges.count; i++) {
+            const RANGE_t *r = &ranges.range[i];
+            memcpy(&merged[ r->begin ], &cardImage[ r->begin ], r->end - r->begin);
+        }
+        return saveImage(merged);
+    }
+
+    // Write the image into the slot not in use, then make it the current one
+    // The journal is folded into the new image, so it starts over
+    bool ImageFile::saveImage(const uint8_t *cardImage)
+    {
+        int slot = (activeSlot == 0) ? 1 : 0;
+        uint64_t gen = generation + 1;
+
+        memcpy(slotData(slot), cardImage, CARD_IMAGE_SIZE);
+        if (!sync(slotData(slot), CARD_IMAGE_SIZE)) return false;
+
+        // The slot becomes current only once its data is on disk
+        IMAGE_SLOT_t *s = &header()->slot[slot];
+        st_be64(s->generation, gen);
+        st_be32(s->checksum, calc_slot_checksum(gen, cardImage));
+        if (!sync(s, sizeof(IMAGE_SLOT_t))) return false;
+
+        activeSlot = slot;
+        generation = gen;
+
+        // A journal of the previous generation is ignored on load, so it only needs to be emptied here
+        JOURNAL_HEADER_t h;
+        memcpy(h.magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC));
+        st_be64(h.generation, generation);
+        journal.clear();
+        journalOpen = writeJournal((const uint8_t *)&h, sizeof(h), true);
+        compactRequired = false;
+        return true;
+    }
+
+    void ImageFile::close(void)
+    {
+        lock_guard<mutex> guard(lock);
+        unmap();
+    }
+
+    void ImageFile::unmap(void)
+    {
+#ifdef _WIN32
+        if (view) UnmapViewOfFile(view);
+        if (hMapping) CloseHandle(hMapping);
+        if (hFile != INVALID_HANDLE_VALUE) CloseHandle(hFile);
+        hMapping = NULL;
+        hFile = INVALID_HANDLE_VALUE;
+#else
+        if (view) munmap(view, IMAGE_FILE_SIZE);
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+#endif
+        view = NULL;
+        activeSlot = -1;
+        generation = 0;
+        journal.clear();
+        journalOpen = false;
+        compactRequired = false;
+    }
+
+    // Map the card image file into memory (create: create or reinitialize the file if it is missing or not in the slot format)
+    bool ImageFile::map(bool create)
+    {
+        if (view) return true;
+        if (!migrate()) return false;
+
+        string name(sys.CARD_IMAGE_FILE_NAME);
+#ifdef _WIN32
+        hFile = CreateFileA(name.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, create ? OPEN_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (hFile == INVALID_HANDLE_VALUE) return false;
+
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(hFile, &size) || (size.QuadPart != IMAGE_FILE_SIZE)) {
+            LARGE_INTEGER newSize;
+            newSize.QuadPart = IMAGE_FILE_SIZE;
+            if (!create || !SetFilePointerEx(hFile, newSize, NULL, FILE_BEGIN) || !SetEndOfFile(hFile)) {
+                unmap();
+                return false;
+            }
+        }
+
+        hMapping = CreateFileMappingA(hFile, NULL, PAGE_READWRITE, 0, IMAGE_FILE_SIZE, NULL);
+        if (hMapping) view = (uint8_t *)MapViewOfFile(hMapping, FILE_MAP_ALL_ACCESS, 0, 0, IMAGE_FILE_SIZE);
+#else
+        fd = open(name.c_str(), O_RDWR | (create ? O_CREAT : 0), 0644);
+        if (fd < 0) return false;
+
+        struct stat st;
+        if ((fstat(fd, &st) != 0) || (st.st_size != IMAGE_FILE_SIZE)) {
+            if (!create || (ftruncate(fd, IMAGE_FILE_SIZE) != 0)) {
+                ::close(fd);
+                fd = -1;
+                return false;
+            }
+        }
+
+        void *p = mmap(NULL, IMAGE_FILE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p != MAP_FAILED) view = (uint8_t *)p;
+#endif
+        if (!view) {
+            unmap();
+            return false;
+        }
+
+        // Another process may be creating the file at the same time
+        if (!lockFile()) {
+            unmap();
+            return false;
+        }
+        bool valid = (memcmp(header()->magic, IMAGE_FILE_MAGIC, sizeof(IMAGE_FILE_MAGIC)) == 0);
+        if (!valid && create) {
+            memset(view, 0x00, IMAGE_FILE_HEADER_SIZE);
+            memcpy(header()->magic, IMAGE_FILE_MAGIC, sizeof(IMAGE_FILE_MAGIC));
+            sync(view, IMAGE_FILE_HEADER_SIZE);
+            valid = true;
+        }
+        unlockFile();
+
+        if (!valid) unmap();
+        return valid;
+    }
+
+    // Take the advisory lock on the card image file (waits while another process holds it)
+    bool ImageFile::lockFile(void)
+    {
+#ifdef _WIN32
+        // The lock is placed past the end of the file, so that it does not restrict access to the mapped view
+        OVERLAPPED ov = {};
+        ov.Offset = IMAGE_FILE_SIZE;
+        return LockFileEx(hFile, LOCKFILE_EXCLUSIVE_LOCK, 0, 1, 0, &ov) != 0;
+#else
+        return flock(fd, LOCK_EX) == 0;
+#endif
+    }
+
+    void ImageFile::unlockFile(void)
+    {
+#ifdef _WIN32
+        OVERLAPPED ov = {};
+        ov.Offset = IMAGE_FILE_SIZE;
+        UnlockFileEx(hFile, 0, 1, 0, &ov);
+#else
+        flock(fd, LOCK_UN);
+#endif
+    }
+
+    // Re-read the slot descriptors and the journal (called with the file locked, since another process may have saved since)
+    void ImageFile::refresh(void)
+    {
+        activeSlot = findActiveSlot(&generation);
+        readJournal();
+    }
+
+    // Size of a file (-1: the file does not exist)
+    static int64_t file_size(const string &name)
+    {
+#ifdef _WIN32
+        WIN32_FILE_ATTRIBUTE_DATA attr;
+        if (!GetFileAttributesExA(name.c_str(), GetFileExInfoStandard, &attr)) return -1;
+        return ((int64_t)attr.nFileSizeHigh << 32) | attr.nFileSizeLow;
+#else
+        struct stat st;
+        if (stat(name.c_str(), &st) != 0) return -1;
+        return st.st_size;
+#endif
+    }
+
+    // Write a new file and wait until it is on disk
+    static bool write_synced_file(const string &name, const uint8_t *data, size_t size)
+    {
+#ifdef _WIN32
+        HANDLE h = CreateFileA(name.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (h == INVALID_HANDLE_VALUE) return false;
+        DWORD written = 0;
+        bool result = WriteFile(h, data, (DWORD)size, &written, NULL) && (written == size) && FlushFileBuffers(h);
+        CloseHandle(h);
+#else
+        int f = open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (f < 0) return false;
+        bool result = (write(f, data, size) == (ssize_t)size) && (fsync(f) == 0);
+        ::close(f);
+#endif
+        if (!result) remove(name.c_str());
+        return result;
+    }
+
+    // Convert a card image file of the previous format (plain 7680-byte image) into the slot format
+    // Returns false only if a file of the previous format exists but could not be converted
+    // The conversion holds the lock of the previous file, so that processes starting at the same time convert it only once:
+    // a process that waited for the lock finds the file already replaced by the converted one
+    bool ImageFile::migrate(void)
+    {
+        string name(sys.CARD_IMAGE_FILE_NAME);
+        if (file_size(name) != CARD_IMAGE_SIZE) return true;
+
+#ifdef _WIN32
+        // Deleting is shared so that the file can be replaced while other processes wait for the lock
+        // Where Windows refuses to replace a file that is still open, this process gives up and the last one to get the lock converts it
+        HANDLE hLegacy = CreateFileA(name.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (hLegacy == INVALID_HANDLE_VALUE) return true;
+        OVERLAPPED ov = {};
+        ov.Offset = IMAGE_FILE_SIZE;
+        if (!LockFileEx(hLegacy, LOCKFILE_EXCLUSIVE_LOCK, 0, 1, 0, &ov)) {
+            CloseHandle(hLegacy);
+            return false;
+        }
+        bool result = convertLegacy(name);
+        UnlockFileEx(hLegacy, 0, 1, 0, &ov);
+        CloseHandle(hLegacy);
+#else
+        int legacy = open(name.c_str(), O_RDONLY);
+        if (legacy < 0) return true;
+        if (flock(legacy, LOCK_EX) != 0) {
+            ::close(legacy);
+            return false;
+        }
+        bool result = convertLegacy(name);
+        flock(legacy, LOCK_UN);
+        ::close(legacy);
+#endif
+        return result;
+    }
+
+    // Write the converted file under a name of this process, then replace the previous file with it (called with the previous file locked)
+    bool ImageFile::convertLegacy(const string &name)
+    {
+        vector<uint8_t> file(IMAGE_FILE_SIZE, 0x00);
+        IMAGE_FILE_HEADER_t *h = (IMAGE_FILE_HEADER_t *)file.data();
+        uint8_t *data = file.data() + IMAGE_FILE_HEADER_SIZE;
+
+        // Checked again now that the lock is held
+        if (file_size(name) != CARD_IMAGE_SIZE) return true;
+        {
+            ifstream fs(name, ios::in | ios::binary);
+            if (!fs || !fs.read((char *)data, CARD_IMAGE_SIZE)) return false;
+        }
+
+        memcpy(h->magic, IMAGE_FILE_MAGIC, sizeof(IMAGE_FILE_MAGIC));
+        st_be64(h->slot[0].generation, 1);
+        st_be32(h->slot[0].checksum, calc_slot_checksum(1, data));
+
+#ifdef _WIN32
+        string tmpName = name + "." + to_string(GetCurrentProcessId()) + ".tmp";
+#else
+        string tmpName = name + "." + to_string(getpid()) + ".tmp";
+#endif
+        if (!write_synced_file(tmpName, file.data(), file.size())) return false;
+
+        // A journal left by another file with the same name could carry generation 1 as well, and would be replayed on the converted image
+        if (!writeJournal(NULL, 0, true)) {
+            remove(tmpName.c_str());
+            return false;
+        }
+#ifdef _WIN32
+        bool result = (MoveFileExA(tmpName.c_str(), name.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0);
+#else
+        bool result = (rename(tmpName.c_str(), name.c_str()) == 0);
+#endif
+        if (!result) remove(tmpName.c_str());
+        return result;
+    }
+
+    // Read the valid records of the journal file for the current image
+    void ImageFile::readJournal(void)
+    {
+        journal.clear();
+        journalOpen = false;
+        compactRequired = false;
+        if (activeSlot < 0) return;
+
+        ifstream fs(string(sys.CARD_IMAGE_FILE_NAME) + ".jnl", ios::in | ios::binary);
+        if (!fs) return;
+        vector<uint8_t> file((istreambuf_iterator<char>(fs)), istreambuf_iterator<char>());
+
+        if (file.size() < sizeof(JOURNAL_HEADER_t)) return;
+        const JOURNAL_HEADER_t *h = (const JOURNAL_HEADER_t *)file.data();
+        if (memcmp(h->magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) != 0) return;
+        if (ld_be64(h->generation) != generation) return;
+        journalOpen = true;
+
+        size_t pos = sizeof(JOURNAL_HEADER_t);
+        while (pos < file.size()) {
+            if (file.size() - pos < sizeof(JOURNAL_RECORD_t)) break;
+            const JOURNAL_RECORD_t *rec = (const JOURNAL_RECORD_t *)&file[pos];
+            const uint8_t *data = (const uint8_t *)(rec + 1);
+            size_t len = ld_be16(rec->length);
+            if (file.size() - pos - sizeof(JOURNAL_RECORD_t) < len) break;
+            if (ld_be16(rec->offset) + len > CARD_IMAGE_SIZE) break;
+            if (ld_be32(rec->checksum) != calc_record_checksum(rec, data)) break;
+            pos += sizeof(JOURNAL_RECORD_t) + len;
+        }
+
+        // Records after a torn one would never be replayed, so the journal is rewritten by the next save
+        if (pos < file.size()) compactRequired = true;
+        journal.assign(file.begin() + sizeof(JOURNAL_HEADER_t), file.begin() + pos);
+    }
+
+    // Apply the journal records to the image in the order they were written
+    void ImageFile::replayJournal(uint8_t *cardImage)
+    {
+        size_t pos = 0;
+        while (pos < journal.size()) {
+            const JOURNAL_RECORD_t *rec = (const JOURNAL_RECORD_t *)&journal[pos];
+            size_t len = ld_be16(rec->length);
+            memcpy(cardImage + ld_be16(rec->offset), rec + 1, len);
+            pos += sizeof(JOURNAL_RECORD_t) + len;
+        }
+    }
+
+    // Write data to the journal file and wait until it is on disk (truncate: replace the contents of the file)
+    bool ImageFile::writeJournal(const uint8_t *data, size_t size, bool truncate)
+    {
+        string name = string(sys.CARD_IMAGE_FILE_NAME) + ".jnl";
+#ifdef _WIN32
+        HANDLE h = CreateFileA(name.c_str(), truncate ? GENERIC_WRITE : FILE_APPEND_DATA, FILE_SHARE_READ, NULL, truncate ? CREATE_ALWAYS : OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (h == INVALID_HANDLE_VALUE) return false;
+        DWORD written = 0;
+        bool result = WriteFile(h, data, (DWORD)size, &written, NULL) && (written == size) && FlushFileBuffers(h);
+        CloseHandle(h);
+#else
+        int f = open(name.c_str(), O_WRONLY | O_CREAT | (truncate ? O_TRUNC : O_APPEND), 0644);
+        if (f < 0) return false;
+        bool result = (write(f, data, size) == (ssize_t)size) && (fsync(f) == 0);
+        ::close(f);
+#endif
+        return result;
+    }
+
+    // Write the mapped range back to the file
+    bool ImageFile::sync(const void *p, size_t size)
+    {
+#ifdef _WIN32
+        return FlushViewOfFile(p, size) && FlushFileBuffers(hFile);
+#else
+        // msync() requires a page-aligned start address
+        uintptr_t pageSize = (uintptr_t)sysconf(_SC_PAGESIZE);
+        uintptr_t start = (uintptr_t)p & ~(pageSize - 1);
+        return msync((void *)start, (uintptr_t)p + size - start, MS_SYNC) == 0;
+#endif
+    }
+
+    IMAGE_FILE_HEADER_t *ImageFile::header(void)
+    {
+        return (IMAGE_FILE_HEADER_t *)view;
+    }
+
+    uint8_t *ImageFile::slotData(int slot)
+    {
+        return view + IMAGE_FILE_HEADER_SIZE + CARD_IMAGE_SIZE * slot;
+    }
+
+    // Find the slot with the newest valid image
+    int ImageFile::findActiveSlot(uint64_t *gen)
+    {
+        int slot = -1;
+        *gen = 0;
+        for (int i = 0; i < 2; i++) {
+            IMAGE_SLOT_t *s = &header()->slot[i];
+            uint64_t g = ld_be64(s->generation);
+            if ((g == 0) || (g <= *gen)) continue;
+            if (ld_be32(s->checksum) != calc_slot_checksum(g, slotData(i))) continue;
+            slot = i;
+            *gen = g;
+        }
+        return slot;
+    }
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <inttypes.h>
+#include <mutex>
+#include <vector>
+#include "card.h"
+
+// Layout of the card image file
+// The header is followed by two slots holding a card image each; the slot with the newer valid generation is the current image
+#define IMAGE_FILE_HEADER_SIZE (4096)
+#define IMAGE_FILE_SIZE        (IMAGE_FILE_HEADER_SIZE + CARD_IMAGE_SIZE * 2)
+
+// Maximum size of the journal file; once exceeded the image is written to a slot and the journal starts over
+#define IMAGE_JOURNAL_MAX_SIZE (64 * 1024)
+
+namespace Cas {
+
+    // Descriptor of one image slot
+    typedef struct {
+        uint8_t generation[8];  // Incremented on every save (0: slot never written)
+        uint8_t checksum[4];    // CRC32 of generation and slot data (a torn write invalidates the slot)
+        uint8_t reserved[4];
+    } IMAGE_SLOT_t;
+
+    typedef struct {
+        uint8_t magic[8];
+        IMAGE_SLOT_t slot[2];
+    } IMAGE_FILE_HEADER_t;
+
+    // Header of the journal file (*.jnl)
+    // The records only apply to the image of the same generation; a journal left over from an older generation is ignored
+    typedef struct {
+        uint8_t magic[8];
+        uint8_t generation[8];
+    } JOURNAL_HEADER_t;
+
+    // Journal record, followed by the modified bytes
+    typedef struct {
+        uint8_t offset[2];      // Offset in the card image
+        uint8_t length[2];
+        uint8_t checksum[4];    // CRC32 of offset, length and data (a torn record ends the journal)
+    } JOURNAL_RECORD_t;
+
+    // Memory-mapped card image file
+    // A save writes the slot not in use and then switches to it by updating its descriptor, so the previous image survives a crash
+    // Small updates are appended to a journal instead, which is replayed on load
+    // Loads and saves hold an advisory lock on the file, so that processes sharing it never write each other's slots
+    class ImageFile {
+    public:
+        ImageFile();
+        ~ImageFile();
+        bool load(uint8_t *cardImage);
+        bool create(uint8_t *cardImage);
+        bool saveDelta(const uint8_t *cardImage, const DirtyRanges &ranges);
+        void close(void);
+
+    private:
+        uint8_t *view = NULL;   // Mapped file (IMAGE_FILE_SIZE bytes)
+#ifdef _WIN32
+        HANDLE hFile = INVALID_HANDLE_VALUE;
+        HANDLE hMapping = NULL;
+#else
+        int fd = -1;
+#endif
+        int activeSlot = -1;    // Slot holding the current image (-1: none)
+        uint64_t generation = 0;
+        vector<uint8_t> journal;        // Valid records of the journal file
+        bool journalOpen = false;       // The journal file has a header for the current generation
+        bool compactRequired = false;   // The journal file has a torn record and must be rewritten
+        mutex lock;                     // Serializes the threads of this process (the file lock is per process)
+
+        bool map(bool create);
+        void unmap(void);
+        bool migrate(void);
+        bool convertLegacy(const string &name);
+        bool lockFile(void);
+        void unlockFile(void);
+        void refresh(void);
+        bool saveImage(const uint8_t *cardImage);
+        bool saveJournal(const uint8_t *cardImage, const DirtyRanges &ranges);
+        bool saveMerged(const uint8_t *cardImage, const DirtyRanges &ranges);
+        void readJournal(void);
+        void replayJournal(uint8_t *cardImage);
+        bool writeJournal(const uint8_t *data, size_t size, bool truncate);
+        bool sync(const void *p, size_t size);
+        IMAGE_FILE_HEADER_t *header(void);
+        uint8_t *slotData(int slot);
+        int findActiveSlot(uint64_t *gen);
+    };
+}
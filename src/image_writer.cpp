@@ -0,0 +1,143 @@
+#include "project.h"
+#include <chrono>
+
+namespace Cas {
+
+    ImageWriter::ImageWriter()
+    {
+    }
+
+    ImageWriter::~ImageWriter()
+    {
+        stop();
+    }
+
+    // Read the card image from the file, with the updates not yet written patched over it
+    // The file is always read, since other processes may have updated it since this one last did
+    bool ImageWriter::load(uint8_t *cardImage)
+    {
+        lock_guard<mutex> file(fileLock);
+        if (!sys.imageFile.load(cardImage)) return false;
+
+        lock_guard<mutex> lock(queueLock);
+        applyPending(cardImage);
+        return true;
+    }
+
+    // Write the initial card image to the file now (used when the file could not be read)
+    // cardImage is replaced by the latest image if another process has created one in the meantime
+    void ImageWriter::create(uint8_t *cardImage)
+    {
+        lock_guard<mutex> file(fileLock);
+        sys.imageFile.create(cardImage);
+
+        lock_guard<mutex> lock(queueLock);
+        applyPending(cardImage);
+    }
+
+    // Queue the modified ranges of a card image to be written (accumulated with the updates not yet written)
+    // Only those ranges are taken from the caller, since each handle's copy of the rest of the image may be stale
+    // The writer thread is started on the first call
+    void ImageWriter::publish(const uint8_t *cardImage, const DirtyRanges &modified)
+    {
+        {
+            lock_guard<mutex> lock(queueLock);
+            if (stopping) return;
+
+            for (int i = 0; i < modified.count; i++) {
+                const RANGE_t *r = &modified.range[i];
+                memcpy(&image[ r->begin ], &cardImage[ r->begin ], r->end - r->begin);
+            }
+            ranges.add(modified);
+            pending = true;
+
+            if (!started) {
+                Utils::pin_module();
+                worker = thread(&ImageWriter::run, this);
+                started = true;
+            }
+        }
+        queueEvent.notify_one();
+    }
+
+    // Stop the writer thread after writing the pending updates
+    void ImageWriter::stop(void)
+    {
+        {
+            lock_guard<mutex> lock(queueLock);
+            if (stopping) return;
+            stopping = true;
+            if (!started) return;
+        }
+        queueEvent.notify_one();
+
+        // Write the updates the writer thread has not written (only left when it could not be joined)
+        if (!Utils::finish_writer_thread(worker, fileLock)) return;
+        uint8_t buf[CARD_IMAGE_SIZE];
+        DirtyRanges modified;
+        if (takeSnapshot(buf, &modified)) {
+            if (!sys.imageFile.saveDelta(buf, modified)) {
+                Log::logout("[Failed to update card image file]\n");
+                Log::logout(NULL);
+            }
+        }
+        fileLock.unlock();
+    }
+
+    // Writer thread main loop
+    void ImageWriter::run(void)
+    {
+        ctx.INS = INS_OPEN;
+
+        unique_lock<mutex> lock(queueLock);
+        for (;;) {
+            queueEvent.wait(lock, [this] { return pending || stopping; });
+            if (!pending) break;
+
+            // Let further updates within the write delay join this write
+            if (sys.imageWriteDelay) {
+                queueEvent.wait_for(lock, chrono::milliseconds(sys.imageWriteDelay), [this] { return stopping; });
+            }
+
+            lock.unlock();
+            writeSnapshot();
+            lock.lock();
+        }
+    }
+
+    // Take a copy of the card image if it has updates waiting to be written
+    bool ImageWriter::takeSnapshot(uint8_t *buf, DirtyRanges *modified)
+    {
+        lock_guard<mutex> lock(queueLock);
+        if (!pending) return false;
+        memcpy(buf, image, sizeof(image));
+        *modified = ranges;
+        ranges.count = 0;
+        pending = false;
+        return true;
+    }
+
+    // Patch the ranges waiting to be written over a card image read from the file (queueLock must be held)
+    void ImageWriter::applyPending(uint8_t *cardImage)
+    {
+        for (int i = 0; i < ranges.count; i++) {
+            const RANGE_t *r = &ranges.range[i];
+            memcpy(&cardImage[ r->begin ], &image[ r->begin ], r->end - r->begin);
+        }
+    }
+
+    // Write the updates waiting to be written
+    // The snapshot is taken with fileLock held, so that load() never sees updates that are neither pending nor in the file
+    void ImageWriter::writeSnapshot(void)
+    {
+        uint8_t buf[CARD_IMAGE_SIZE];
+        DirtyRanges modified;
+
+        lock_guard<mutex> file(fileLock);
+        if (!takeSnapshot(buf, &modified)) return;
+        if (!sys.imageFile.saveDelta(buf, modified)) {
+            Log::logout("[Failed to update card image file]\n");
+            Log::logout(NULL);
+        }
+    }
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <condition_variable>
+#include <inttypes.h>
+#include <mutex>
+#include <thread>
+#include "card.h"
+
+namespace Cas {
+
+    // Writes the card image file on a background thread
+    // Keeps the updates of all card handles not yet written: each handle only patches the ranges it modified into a shared image,
+    // and updates published within the write delay are coalesced into a single file write
+    class ImageWriter {
+    public:
+        ImageWriter();
+        ~ImageWriter();
+        bool load(uint8_t *cardImage);
+        void create(uint8_t *cardImage);
+        void publish(const uint8_t *cardImage, const DirtyRanges &ranges);
+        void stop(void);
+
+    private:
+        uint8_t image[CARD_IMAGE_SIZE];  // Card image updates not yet written (only valid within ranges)
+        DirtyRanges ranges;              // Ranges modified by all updates since the last write
+        bool pending = false;            // image holds updates waiting to be written
+        bool stopping = false;
+        bool started = false;
+        mutex queueLock;                 // Protects image and the flags above (never held during file I/O)
+        mutex fileLock;                  // Serializes reads and writes of the card image file
+        condition_variable queueEvent;
+        thread worker;
+
+        void run(void);
+        bool takeSnapshot(uint8_t *buf, DirtyRanges *modified);
+        void writeSnapshot(void);
+        void applyPending(uint8_t *cardImage);
+    };
+}
@@ -1,9 +1,16 @@
 ﻿#include "project.h"
-#include <fstream>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
 #include <sstream>
 #include <stddef.h>
+#include <thread>
 
-#define LOG_BUFFER_FLASH_SIZE 2048  // An approximate timing to flush the log file
+#define LOG_BUFFER_FLASH_SIZE 2048  // An approximate timing to hand the buffered lines over to the writer thread
+#define LOG_RING_SLOT_COUNT 128     // Number of chunks the ring buffer holds (bounds the memory used by log output not yet written)
+#define LOG_RING_SLOT_SIZE 4096     // Maximum length of a chunk (LOG_BUFFER_FLASH_SIZE plus one formatted line fits)
+#define LOG_WRITE_INTERVAL 100      // Time in ms after which the writer thread writes the pushed chunks without being woken
 #define membersizeof(st, member) sizeof(((st *)0)->member)  // Macro to get the size of a structure member
 #define addrItem(st, member, name) { offsetof(st, member), membersizeof(st, member), name }
 
@@ -15,52 +22,253 @@ namespace Log {
         const char *name;
     } mem_t;
 
-    static string logBuffer;
-    static bool logInit = false;
+    // One chunk of log text in the ring buffer
+    // turn is even while the slot is free and odd while it holds a chunk, it advances by 2 on every lap of the ring
+    typedef struct {
+        atomic<uint64_t> turn;
+        uint32_t length;
+        char text[LOG_RING_SLOT_SIZE];
+    } slot_t;
+
+    enum { WRITER_IDLE, WRITER_RUNNING, WRITER_STOPPED };
+
+    // Each thread buffers its own lines so that concurrent commands are not interleaved
+    // A plain array, since the library destructor still logs after the thread_local objects of the main thread are destroyed
+    static thread_local char logBuffer[ LOG_RING_SLOT_SIZE ];
+    static thread_local size_t logLength = 0;
+    static mutex logFileLock;               // Serializes appends to the log file
+
+    // Multi-producer single-consumer ring buffer of chunks waiting to be written
+    // Command threads never block on it: when it is full, the chunk is dropped and counted
+    static slot_t ring[LOG_RING_SLOT_COUNT];
+    static atomic<uint64_t> ringHead(0);     // Next position to push (shared by the command threads)
+    static uint64_t ringTail = 0;            // Next position to pop (writer thread, or shutdown() once it has stopped)
+    static atomic<uint64_t> dropCount(0);    // Chunks dropped since the last report in the log file
+    static atomic<int> writerState(WRITER_IDLE);
+    static mutex writerLock;                 // Protects starting and stopping the writer thread
+    static FILE *logFile = NULL;             // Kept open while the writer thread runs
+
+    bitset<256> insEnable;
+    bitset<256> binaryEnable;
+
+    // Writer thread and its wake-up event
+    // Created on first use, since the first log lines are written by SystemInit() before the static objects of this file are constructed
+    class Writer {
+    public:
+        ~Writer() { shutdown(); }  // A joinable thread must not be destroyed
+        thread worker;
+        condition_variable event;
+    };
+
+    static Writer &writer(void)
+    {
+        static Writer w;
+        return w;
+    }
 
-    static void _logout(const char *fmt, va_list ap)
+    // Append text to the log file, opening it on first use
+    static void write_file(const char *text, size_t length)
     {
-        char txt[1024];
+        if (!logFile) logFile = fopen(string(sys.LOG_FILE_NAME).c_str(), "a");
+        if (logFile) fwrite(text, 1, length, logFile);
+    }
 
-        if (!logInit) {
-            logInit = true;
-            logBuffer.clear();
+    // Write every chunk in the ring buffer to the log file (called with logFileLock held)
+    static void write_ring(void)
+    {
+        bool written = false;
+        for (;;) {
+            slot_t *slot = &ring[ ringTail % LOG_RING_SLOT_COUNT ];
+            uint64_t turn = (ringTail / LOG_RING_SLOT_COUNT) * 2;
+            if (slot->turn.load(memory_order_acquire) != turn + 1) break;
+            write_file(slot->text, slot->length);
+            slot->turn.store(turn + 2, memory_order_release);
+            ringTail++;
+            written = true;
         }
 
-        if (fmt) {
-            vsnprintf(txt, sizeof(txt), fmt, ap);
-            if (txt[0]) {
-                logBuffer.append(txt);
+        uint64_t dropped = dropCount.exchange(0);
+        if (dropped) {
+            char txt[128];
+            int len = snprintf(txt, sizeof(txt), "\n[Log buffer full: %llu chunks dropped]\n\n", (unsigned long long)dropped);
+            write_file(txt, len);
+            written = true;
+        }
+        if (written && logFile) fflush(logFile);
+    }
+
+    static void drain(void)
+    {
+        lock_guard<mutex> lock(logFileLock);
+        write_ring();
+    }
+
+    // Writer thread main loop
+    static void run(void)
+    {
+        unique_lock<mutex> lock(writerLock);
+        while (writerState == WRITER_RUNNING) {
+            writer().event.wait_for(lock, chrono::milliseconds(LOG_WRITE_INTERVAL));
+            lock.unlock();
+            drain();
+            lock.lock();
+        }
+    }
+
+    // Hand a chunk over to the writer thread (never blocks)
+    static void push(const char *text, size_t length, bool wake)
+    {
+        if (writerState.load(memory_order_acquire) != WRITER_RUNNING) {
+            unique_lock<mutex> lock(writerLock);
+            if (writerState == WRITER_STOPPED) {
+                // Lines logged after shutdown() are written directly
+                lock.unlock();
+                lock_guard<mutex> fileLock(logFileLock);
+                write_file(text, length);
+                if (logFile) {
+                    fclose(logFile);
+                    logFile = NULL;
+                }
+                return;
+            }
+            // The writer thread is started by the first command (DllMain must not start threads), the startup lines wait in the ring buffer
+            if ((writerState == WRITER_IDLE) && (ctx.INS != INS_OPEN)) {
+                writerState = WRITER_RUNNING;
+                Utils::pin_module();
+                writer().worker = thread(run);
+            }
+        }
+
+        while (length) {
+            size_t len = (length > LOG_RING_SLOT_SIZE) ? LOG_RING_SLOT_SIZE : length;
+
+            // Claim the slot at the head position unless the writer thread has not emptied it yet
+            uint64_t pos = ringHead.load(memory_order_relaxed);
+            slot_t *slot;
+            for (;;) {
+                slot = &ring[ pos % LOG_RING_SLOT_COUNT ];
+                if (slot->turn.load(memory_order_acquire) == (pos / LOG_RING_SLOT_COUNT) * 2) {
+                    if (ringHead.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) break;
+                } else {
+                    uint64_t prev = pos;
+                    pos = ringHead.load(memory_order_relaxed);
+                    if (pos == prev) {
+                        slot = NULL;  // Full
+                        break;
+                    }
+                }
+            }
+
+            if (slot) {
+                memcpy(slot->text, text, len);
+                slot->length = (uint32_t)len;
+                slot->turn.store((pos / LOG_RING_SLOT_COUNT) * 2 + 1, memory_order_release);
+            } else {
+                dropCount++;
+                wake = true;
+            }
+            text += len;
+            length -= len;
+        }
+
+        if (wake) writer().event.notify_one();
+    }
+
+    // Append text to the line buffer of this thread (NULL: hand the buffer over to the writer thread now)
+    static void append(const char *text, size_t length)
+    {
+        if (text) {
+            if (logLength + length > sizeof(logBuffer)) {
+                push(logBuffer, logLength, false);
+                logLength = 0;
+            }
+            if (length > sizeof(logBuffer)) {
+                push(text, length, false);  // Too long for the line buffer (large dumps)
+            } else {
+                memcpy(&logBuffer[ logLength ], text, length);
+                logLength += length;
+            }
 #if false
-                fprintf(stderr, "%s", txt);  // For debugging
+            fprintf(stderr, "%.*s", (int)length, text);  // For debugging
 #endif
-            }
         }
 
-        if ((fmt == NULL) || (logBuffer.size() >= LOG_BUFFER_FLASH_SIZE)) {
-            ofstream fs(sys.LOG_FILE_NAME, ios::app);
-            if (fs) fs << logBuffer << std::flush;
-            logBuffer.clear();
+        if ((text == NULL) || (logLength >= LOG_BUFFER_FLASH_SIZE)) {
+            push(logBuffer, logLength, (text == NULL));
+            logLength = 0;
         }
     }
 
-    // Append to the regular log file (same format as printf())
-    void logout(const char *fmt, ...)
+    static void _logout(const char *fmt, va_list ap)
     {
-        bool logEnable = false;
-        logEnable = (sys.logMode == LOG_ALL);                                             // Is all log output enabled?
-
-        if (!logEnable) logEnable = ((sys.logMode & LOG_EMM) && (sys.INS == INS_EMM));    // Is EMM log output enabled?
-        if (!logEnable) logEnable = ((sys.logMode & LOG_EMG) && (sys.INS == INS_EMG));    // Is EMG log output enabled?
-        if (!logEnable) logEnable = ((sys.logMode & LOG_EMD) && (sys.INS == INS_EMD));    // Is EMD log output enabled?
-        if (!logEnable) logEnable = ((sys.logMode & LOG_ECM) && (sys.INS == INS_ECM));    // Is ECM log output enabled?
-        if (!logEnable) logEnable = ((sys.logMode & LOG_CHK) && (sys.INS == INS_CHK));    // Is CHK log output enabled?
-        if (!logEnable) logEnable = ((sys.logMode & LOG_OPEN) && (sys.INS == INS_OPEN));  // Is startup log output enabled?
-        if ((!logEnable) && (sys.logMode & LOG_ETC)) {                                    // Is other command output enabled?
-            logEnable = ((sys.INS != INS_EMM) && (sys.INS != INS_EMG) && (sys.INS != INS_EMD) && (sys.INS != INS_ECM) && (sys.INS != INS_CHK)  && (sys.INS != INS_OPEN));
+        char txt[1024];
+
+        if (fmt) {
+            vsnprintf(txt, sizeof(txt), fmt, ap);
+            if (txt[0]) append(txt, strlen(txt));
+        } else {
+            append(NULL, 0);
         }
+    }
+
+    // Write the chunks pushed so far on the calling thread (for tools that log faster than the writer thread writes)
+    void flush(void)
+    {
+        drain();
+    }
 
-        if (logEnable) {
+    // Stop the writer thread after writing everything pushed so far, and close the log file
+    void shutdown(void)
+    {
+        {
+            lock_guard<mutex> lock(writerLock);
+            bool running = (writerState == WRITER_RUNNING);
+            bool stopped = (writerState == WRITER_STOPPED);
+            writerState = WRITER_STOPPED;
+            if (stopped) return;
+            if (running) writer().event.notify_one();
+        }
+
+        // Write the remaining chunks and close the file
+        if (!Utils::finish_writer_thread(writer().worker, logFileLock)) return;
+        write_ring();
+        if (logFile) fclose(logFile);
+        logFile = NULL;
+        logFileLock.unlock();
+    }
+
+    // Set the log mode and build the log output enable table for each INS code from it
+    // With LOG_BINARY the selected commands go to the binary log and the text log stays disabled
+    void set_mode(uint16_t logMode)
+    {
+        sys.logMode = logMode;
+        insEnable.reset();
+        binaryEnable.reset();
+        bitset<256> &table = (logMode & LOG_BINARY) ? binaryEnable : insEnable;
+        logMode &= ~LOG_BINARY;
+        if (!logMode) return;                                                         // Log output disabled
+
+        for (int ins = 0; ins < 256; ins++) {
+            bool logEnable = false;
+            logEnable = (logMode == LOG_ALL);                                         // Is all log output enabled?
+
+            if (!logEnable) logEnable = ((logMode & LOG_EMM) && (ins == INS_EMM));    // Is EMM log output enabled?
+            if (!logEnable) logEnable = ((logMode & LOG_EMG) && (ins == INS_EMG));    // Is EMG log output enabled?
+            if (!logEnable) logEnable = ((logMode & LOG_EMD) && (ins == INS_EMD));    // Is EMD log output enabled?
+            if (!logEnable) logEnable = ((logMode & LOG_ECM) && (ins == INS_ECM));    // Is ECM log output enabled?
+            if (!logEnable) logEnable = ((logMode & LOG_CHK) && (ins == INS_CHK));    // Is CHK log output enabled?
+            if (!logEnable) logEnable = ((logMode & LOG_OPEN) && (ins == INS_OPEN));  // Is startup log output enabled?
+            if ((!logEnable) && (logMode & LOG_ETC)) {                                // Is other command output enabled?
+                logEnable = ((ins != INS_EMM) && (ins != INS_EMG) && (ins != INS_EMD) && (ins != INS_ECM) && (ins != INS_CHK)  && (ins != INS_OPEN));
+            }
+            table[ ins ] = logEnable;
+        }
+    }
+
+    // Append to the regular log file (same format as printf())
+    void logout(const char *fmt, ...)
+    {
+        if (is_enabled()) {
             va_list ap;
             if (fmt) va_start(ap, fmt);
             _logout(fmt, ap);
@@ -69,40 +277,56 @@ namespace Log {
     }
 
     // Append send/receive data to the regular log file
+    // The whole buffer is encoded in one pass with a table and appended at once (same output as "%02x " for each byte)
     void logout_command_dump(const void *p, uint16_t size)
     {
-        if (size <= 0) return;
+        if ((size <= 0) || !is_enabled()) return;
 
+        static const char HEX_LOWER[] = "0123456789abcdef";
+        string txt(size * 3 - 1, ' ');
+        char *out = &txt[0];
         const uint8_t *pp = (const uint8_t *)p;
         for (uint16_t i = 0; i < size; i++) {
-            logout((i == (size - 1)) ? "%02x" : "%02x ", *pp++);
+            out[0] = HEX_LOWER[ *pp >> 4 ];
+            out[1] = HEX_LOWER[ *pp & 0x0f ];
+            out += 3;
+            pp++;
         }
+        append(txt.data(), txt.size());
     }
 
     // Append data dump to the regular log file
+    // With tabCount, 32 bytes are output per line and the following lines are indented by tabCount * 4 spaces
     void logout_dump(const void *p, uint16_t size, uint16_t tabCount)
     {
-        if (size <= 0) return;
+        if ((size <= 0) || !is_enabled()) return;
+
+        static const char HEX_UPPER[] = "0123456789ABCDEF";
+        size_t lineCount = tabCount ? ((size + 31) / 32) : 1;
+        string txt;
+        txt.reserve(size * 3 + lineCount * (tabCount * 4 + 1));
 
         const uint8_t *pp = (const uint8_t *)p;
         for (uint16_t i = 0; i < size; i++) {
             if (tabCount) {
                 if (!(i % 32) && i) {
-                    logout("\n");
-                    for (int j = 0; j < tabCount; j++) {
-                        logout("    ");
-                    }
+                    txt.push_back('\n');
+                    txt.append(tabCount * 4, ' ');
                 }
             }
-            logout((((i % 32) == 31 && tabCount) || (i == (size - 1))) ? "%02X" : "%02X ", *pp++);
+            txt.push_back(HEX_UPPER[ *pp >> 4 ]);
+            txt.push_back(HEX_UPPER[ *pp & 0x0f ]);
+            if (!(((i % 32) == 31 && tabCount) || (i == (size - 1)))) txt.push_back(' ');
+            pp++;
         }
-        if (tabCount) logout("\n");
+        if (tabCount) txt.push_back('\n');
+        append(txt.data(), txt.size());
     }
 
     // Append contract bitmap information to the regular log file
     void logout_bitmap(const uint8_t *bitmap, uint16_t size, uint16_t spaceCount)
     {
-        if (size <= 0) return;
+        if ((size <= 0) || !is_enabled()) return;
 
         string buf;
         const uint8_t *p = bitmap;
@@ -129,7 +353,7 @@ namespace Log {
 
     void logout_timestamp(void)
     {
-        logout("---- %s ----------------\n", Utils::now_datetime_string());
+        LOGOUT("---- %s ----------------\n", Utils::now_datetime_string());
     }
 
     // Create a log of the data sent from the card reader
@@ -168,6 +392,8 @@ namespace Log {
 
     void logout_address_name(uint16_t address)
     {
+        if (!is_enabled()) return;
+
         // Header member information
         const static mem_t ITEMS_INFO[] = {  // 0x0000 ~ 0x0030
             addrItem(Cas::INFO_t, ca_system_id , "CA system ID"               ),  // 0x0000[2]
@@ -1,7 +1,18 @@
 #pragma once
 
+// Append to the regular log file (same format as printf())
+// The arguments are only evaluated when logging is enabled for the current command, so formatting helpers cost nothing otherwise
+#define LOGOUT(...) do { if (Log::is_enabled()) Log::logout(__VA_ARGS__); } while (0)
+
 namespace Log {
 
+    // Log output enable flag for each INS code (built from sys.logMode by set_mode())
+    // Kept out of sys so that it is constant-initialized and not cleared when sys is constructed after SystemInit() has run
+    extern bitset<256> insEnable;
+    extern bitset<256> binaryEnable;  // Binary log enable flag for each INS code (LOG_BINARY)
+
+    void set_mode(uint16_t logMode);
+    inline bool is_enabled(void);
     void logout(const char *fmt, ...);
     void logout_command_dump(const void *p, uint16_t size);
     void logout_dump(const void *p, uint16_t size, uint16_t tabCount);
@@ -10,4 +21,6 @@ namespace Log {
     void logout_send_raw_data(const void *data, uint16_t size);
     void logout_receive_raw_data(const void *data, uint16_t size);
     void logout_address_name(uint16_t address);
+    void flush(void);
+    void shutdown(void);
 }
@@ -49,6 +49,7 @@ using namespace std;               // Omitting std:: in namespace for readabilit
 #define LOG_CHK  0x0020
 #define LOG_OPEN 0x0040
 #define LOG_ETC  0x0080
+#define LOG_BINARY 0x0100  // Record the selected commands to the capture file (*.trc) instead of the text log (render it with trace_print)
 
 // Message control area status definition
 #define MSG_STS_DoNotShow 0x00                          // Not displayed
@@ -56,38 +57,60 @@ using namespace std;               // Omitting std:: in namespace for readabilit
 #define MSG_STS_DuringDisplayGracePeriodOrDisplay 0x02  // During display grace period or display
 #define MSG_STS_Showing   0x03                          // Displaying
 
+#include <bitset>
 #include <string>
 #include "utils.h"
 #include "key_manager.h"
 #include "ldst.h"
 #include "crypto.h"
 #include "card.h"
+#include "image_file.h"
+#include "image_writer.h"
 #include "log.h"
+#include "capture.h"
 
 // Common variables in the system
 struct System {
-    uint8_t INS;                       // Currently executing INS code (0xFF: during startup)
     Cas::KeyManager keySets;           // Work key information
+    Cas::ImageFile imageFile;          // Memory-mapped card image file
+    Cas::ImageWriter imageWriter;      // Background writer of the card image file
     uint8_t cardVersion;               // Card version number being emulated (default value is 2, 3 is partially supported)
-    uint16_t logMode;                  // Log mode (0: disable, 1: all, 2: EMM, 4: EMG, 8: EMD, 16: ECM, 32: CHK, 64: startup, 128: other)
+    uint16_t logMode;                  // Log mode (0: disable, 1: all, 2: EMM, 4: EMG, 8: EMD, 16: ECM, 32: CHK, 64: startup, 128: other, +256: binary log)
     bool clModeEnable;                 // CL mode enable/disable
+    uint32_t imageWriteDelay;          // Time in ms to wait for further card image updates before writing the file (0: write immediately)
+    bool captureEnable;                // Record every command with its response to the capture file for offline replay
     uint64_t initGroupID[8];           // Group ID to be applied to the card image at initial startup / [0]: main ID
     uint64_t initGroupIDKm[8];         // Group ID Km to be applied to the card image at initial startup / [0]: main Km
 #ifdef _WIN32
     string CARD_IMAGE_FILE_NAME;       // Card image save file name (*.bin)
     string LOG_FILE_NAME;              // Log file name (*.log)
+    string CAPTURE_FILE_NAME;          // APDU capture file name (*.trc)
 #else
     const char *CARD_IMAGE_FILE_NAME;  // Card image save file name (*.bin)
     const char *LOG_FILE_NAME;         // Log file name (*.log)
+    const char *CAPTURE_FILE_NAME;     // APDU capture file name (*.trc)
 #endif
 };
 
+// Per-thread state of the command being executed (each tuner thread has its own copy)
+struct Context {
+    uint8_t INS;                       // Currently executing INS code (0xFF: during startup)
+};
+
 #ifdef _WINSCARD_CPP_
     struct System sys;
+    thread_local struct Context ctx;
 #else
     extern struct System sys;
+    extern thread_local struct Context ctx;
 #endif
 
+// Is log output enabled for the command being processed? (a single table lookup, inlined into every call site)
+inline bool Log::is_enabled(void)
+{
+    return Log::insEnable[ ctx.INS ];
+}
+
 #ifndef _WIN32
 
 // for Linux
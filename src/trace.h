@@ -0,0 +1,90 @@
+#pragma once
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include "ldst.h"
+
+// Layout of the APDU trace file (*.trc), written by the APDU capture and the binary log
+// The header is followed by records, each one followed by the command bytes and then the response bytes
+// All multi-byte fields are big-endian so a trace can be replayed on any machine
+#define TRACE_APDU_MAX_LENGTH (300)
+
+namespace Trace {
+
+    static const uint8_t TRACE_FILE_MAGIC[8] = { 'C', 'C', 'A', 'S', 'T', 'R', 'C', 0x02 };  // The last byte is the format version
+
+    typedef struct {
+        uint8_t magic[8];
+    } TRACE_FILE_HEADER_t;
+
+    typedef struct {
+        uint8_t timestamp[8];       // Nanoseconds since the start of the trace (0: not recorded)
+        uint8_t threadID[4];        // Thread that sent the command (0: not recorded)
+        uint8_t latency[4];         // Nanoseconds SCardTransmit() took to process the command (0: not recorded)
+        uint8_t ins;                // INS code of the command (0: not a 0x90 class command)
+        uint8_t reserved;
+        uint8_t returnCode[2];      // Return code of the response (0: the response has no return code)
+        uint8_t commandLength[2];
+        uint8_t responseLength[2];  // 0: response not recorded (generated traffic)
+    } TRACE_RECORD_t;
+
+    // One command with its response as held in memory
+    typedef struct {
+        uint64_t timestamp;
+        uint32_t threadID;
+        uint32_t latency;
+        uint8_t ins;
+        uint16_t returnCode;
+        uint16_t commandLength;
+        uint16_t responseLength;
+        uint8_t command[ TRACE_APDU_MAX_LENGTH ];
+        uint8_t response[ TRACE_APDU_MAX_LENGTH ];
+    } APDU_t;
+
+    static inline bool write_header(FILE *fp)
+    {
+        TRACE_FILE_HEADER_t h;
+        memcpy(h.magic, TRACE_FILE_MAGIC, sizeof(TRACE_FILE_MAGIC));
+        return fwrite(&h, sizeof(h), 1, fp) == 1;
+    }
+
+    static inline bool read_header(FILE *fp)
+    {
+        TRACE_FILE_HEADER_t h;
+        return (fread(&h, sizeof(h), 1, fp) == 1) && (memcmp(h.magic, TRACE_FILE_MAGIC, sizeof(TRACE_FILE_MAGIC)) == 0);
+    }
+
+    static inline bool write_record(FILE *fp, const APDU_t &a)
+    {
+        TRACE_RECORD_t r;
+        st_be64(r.timestamp, a.timestamp);
+        st_be32(r.threadID, a.threadID);
+        st_be32(r.latency, a.latency);
+        r.ins = a.ins;
+        r.reserved = 0;
+        st_be16(r.returnCode, a.returnCode);
+        st_be16(r.commandLength, a.commandLength);
+        st_be16(r.responseLength, a.responseLength);
+        return (fwrite(&r, sizeof(r), 1, fp) == 1) &&
+               (fwrite(a.command, 1, a.commandLength, fp) == a.commandLength) &&
+               (fwrite(a.response, 1, a.responseLength, fp) == a.responseLength);
+    }
+
+    // Returns false at the end of the file or on a broken record
+    static inline bool read_record(FILE *fp, APDU_t *a)
+    {
+        TRACE_RECORD_t r;
+        if (fread(&r, sizeof(r), 1, fp) != 1) return false;
+        a->timestamp = ld_be64(r.timestamp);
+        a->threadID = ld_be32(r.threadID);
+        a->latency = ld_be32(r.latency);
+        a->ins = r.ins;
+        a->returnCode = ld_be16(r.returnCode);
+        a->commandLength = ld_be16(r.commandLength);
+        a->responseLength = ld_be16(r.responseLength);
+        if ((a->commandLength > TRACE_APDU_MAX_LENGTH) || (a->responseLength > TRACE_APDU_MAX_LENGTH)) return false;
+        return (fread(a->command, 1, a->commandLength, fp) == a->commandLength) &&
+               (fread(a->response, 1, a->responseLength, fp) == a->responseLength);
+    }
+}
@@ -1,10 +1,39 @@
 #include "project.h"
-#include <fstream>
 #include <stdio.h>
 #include <time.h>
 
 namespace Utils {
 
+    // Keep the library loaded until the process exits (called before starting a writer thread)
+    // On Windows a writer thread cannot be joined from DllMain, so FreeLibrary would unmap the code it is still running;
+    // once pinned, DLL_PROCESS_DETACH only comes at process exit, after the threads have been terminated
+    void pin_module(void)
+    {
+#ifdef _WIN32
+        HMODULE hModule;
+        GetModuleHandleExA(GET_MODULE_HANDLE_EX_FLAG_PIN | GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS, (LPCSTR)&pin_module, &hModule);
+#endif
+    }
+
+    // Wait for a writer thread that has been told to stop, so that the caller can write what it left (called on library unload)
+    // Returns true with fileLock held if the caller may write to the file
+    bool finish_writer_thread(thread &worker, mutex &fileLock)
+    {
+#ifdef _WIN32
+        // Joining a thread from DllMain deadlocks on the loader lock; since the library is pinned while a writer thread exists,
+        // this is process exit, where the thread has already been terminated
+        // The thread is detached instead, and the caller writes the rest unless the thread died owning the file
+        if (worker.joinable()) {
+            worker.detach();
+            return fileLock.try_lock();
+        }
+#else
+        if (worker.joinable()) worker.join();
+#endif
+        fileLock.lock();
+        return true;
+    }
+
     // Convert date to Modified Julian Day (MJD)
     long date_to_mjd(int y, int m, int d)
     {
@@ -49,25 +78,6 @@ namespace Utils {
     }
 #endif
 
-    // Load card image file (7680 bytes)
-    bool load_card_image(uint8_t *buf)
-    {
-        ifstream fs(sys.CARD_IMAGE_FILE_NAME, ios::in | ios::binary);
-        if (!fs) return false;
-        fs.read((char *)buf, 7680);
-        return true;
-    }
-
-    // Save card image file (7680 bytes)
-    bool save_card_image(const uint8_t *buf)
-    {
-        ofstream fs(sys.CARD_IMAGE_FILE_NAME, ios::out | ios::binary | ios::trunc);
-        if (!fs) return false;
-        fs.write((char *)buf, 7680);
-        fs.flush();
-        return true;
-    }
-
     // Calculate Km check digit
     uint8_t calc_Km_check_digit(uint64_t Km)  // 64-bit value
     {
@@ -152,7 +162,7 @@ namespace Utils {
     // Pass 48-bit ID / sts returns group ID (NULL can be specified)
     const char *cardID_to_string(uint64_t id, int *sts)
     {
-        static char txt[32];
+        static thread_local char txt[32];
 
         const uint16_t checkDigit = calc_cardID_check_digit(id);  // Calculate check digit
         const uint8_t GroupID = (uint8_t)(id >> 45);  // Get group ID (card type?)
@@ -176,7 +186,7 @@ namespace Utils {
     // Convert MJD to date string
     const char *mjd_to_string(int mjd)
     {
-        static char txt[32];
+        static thread_local char txt[32];
         int y, m, d;
         mjd_to_date(&y, &m, &d, mjd);
         sprintf(txt, "0x%04X (%04d-%02d-%02d)", (uint16_t)(mjd & 0xffff), y, m, d);
@@ -186,7 +196,7 @@ namespace Utils {
     // Convert time data (BCD format 3 bytes) to string
     const char *time_to_string(uint8_t *p)
     {
-        static char txt[20];
+        static thread_local char txt[20];
         int h = ((p[0] >> 4) * 10) + (p[0] & 0x0f);
         int m = ((p[1] >> 4) * 10) + (p[1] & 0x0f);
         int s = ((p[2] >> 4) * 10) + (p[2] & 0x0f);
@@ -197,9 +207,15 @@ namespace Utils {
     // Return current date and time as a string ("yyyy-mm-dd hh:mm:ss")
     const char *now_datetime_string(void)
     {
-        static char txt[32];
+        static thread_local char txt[32];
         time_t now = time(NULL);
-        strftime(txt, sizeof(txt), "%Y-%m-%d %H:%M:%S", localtime(&now));
+        struct tm local;
+#ifdef _WIN32
+        localtime_s(&local, &now);
+#else
+        localtime_r(&now, &local);
+#endif
+        strftime(txt, sizeof(txt), "%Y-%m-%d %H:%M:%S", &local);
         return txt;
     }
 
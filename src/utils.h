@@ -4,6 +4,8 @@
 #include <windows.h>
 #endif
 #include <inttypes.h>
+#include <mutex>
+#include <thread>
 #include <vector>
 #include "card.h"
 
@@ -14,8 +16,6 @@ namespace Utils {
 #ifdef _WIN32
     string get_dll_file_name(HINSTANCE hn);
 #endif
-    bool load_card_image(uint8_t *buf);
-    bool save_card_image(const uint8_t *buf);
     uint16_t calc_cardID_check_digit(uint64_t id);
     uint8_t calc_Km_check_digit(uint64_t Km);
     uint8_t calc_tier_check_digit(Cas::TIER_t *pTier);
@@ -27,4 +27,6 @@ namespace Utils {
     const char *now_datetime_string(void);
     const char *BroadcastGroupID_to_name(uint8_t BroadcastGroupID);
     bool is_all_zero(void *data, int size);
+    void pin_module(void);
+    bool finish_writer_thread(thread &worker, mutex &fileLock);
 }
@@ -5,8 +5,13 @@
 #endif
 #include "project.h"
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <fstream>
+#include <mutex>
 #include <sstream>
+#include <thread>
 #ifdef _WIN32
 #include <windows.h>
 #include <winscard.h>
@@ -26,6 +31,9 @@ static bool SystemInit();
 
 //#define ALLLOG
 
+#define CARD_HANDLE_COUNT 64          // Maximum number of card handles that can be connected at the same time (up to 256)
+#define CARD_HANDLE_BASE  0x35000000  // Card handle number marker (bits 8-23: slot generation, bits 0-7: slot index)
+
 //
 //
 // Card reader status variables
@@ -33,13 +41,122 @@ static const CHAR     readerNameA[]           =  "CobaltCas Smart Card Reader\0\
 #ifdef _WIN32
 static const WCHAR    readerNameW[]           = L"CobaltCas Smart Card Reader\0\0";
 #endif
-static Cas::Card      *card                   = NULL;        // Card emulator object
+// Card handle slot
+// SCardDisconnect() retires the slot by advancing its generation (stale handles of the slot are rejected from then on),
+// and deletes the card once no SCardTransmit() holds it any more
+typedef struct {
+    atomic<Cas::Card *> card;        // Card emulator object of the handle (NULL: free)
+    atomic<uint32_t> generation;     // Number of times the slot has been retired
+    atomic<uint32_t> users;          // SCardTransmit() calls holding the card
+} cardSlot_t;
+
+static cardSlot_t     cards[CARD_HANDLE_COUNT];              // Card handle table
 #ifdef _WIN32
 static HANDLE         h_SCardStartedEvent     = NULL;        // Card reader handle number
 #else
 static SCARDHANDLE    h_SCardStartedEvent     = 0x35313239;  // Card reader handle number (dummy)
 #endif
-static bool           isSCardCancelCalled     = false;       // SCardCancel() is called
+static atomic<bool>   isSCardCancelCalled(false);            // SCardCancel() is called
+static mutex          cancelLock;                            // Protects the wait on cancelEvent
+static condition_variable cancelEvent;                       // Signaled by SCardCancel()
+
+//
+//
+// Card handle table (lock-free: each slot is claimed with an atomic exchange, and held by a use count while a command runs)
+static cardSlot_t *findSlot(SCARDHANDLE hCard, uint32_t *generation)
+{
+    uintptr_t handle = (uintptr_t)hCard;
+    uintptr_t idx = handle & 0xFF;
+    if (((handle & ~(uintptr_t)0xFFFFFF) != CARD_HANDLE_BASE) || (idx >= CARD_HANDLE_COUNT)) return NULL;
+    *generation = (uint32_t)(handle >> 8) & 0xFFFF;
+    return &cards[idx];
+}
+
+static bool attachCard(Cas::Card *card, LPSCARDHANDLE phCard)
+{
+    for (int i = 0; i < CARD_HANDLE_COUNT; i++) {
+        Cas::Card *expected = NULL;
+        if (cards[i].card.compare_exchange_strong(expected, card)) {
+            uint32_t generation = cards[i].generation.load() & 0xFFFF;
+            *phCard = (SCARDHANDLE)(CARD_HANDLE_BASE + (generation << 8) + i);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Take the card of a handle for the duration of a command (NULL: invalid or disconnected handle)
+// Every non-NULL result must be given back with releaseCard()
+static Cas::Card *acquireCard(SCARDHANDLE hCard)
+{
+    uint32_t generation;
+    cardSlot_t *slot = findSlot(hCard, &generation);
+    if (!slot) return NULL;
+
+    // The use count is raised before the generation is checked, so retireSlot() either rejects this handle or waits for it
+    slot->users.fetch_add(1);
+    Cas::Card *card = slot->card.load();
+    if (card && ((slot->generation.load() & 0xFFFF) == generation)) return card;
+    slot->users.fetch_sub(1);
+    return NULL;
+}
+
+static void releaseCard(SCARDHANDLE hCard)
+{
+    uint32_t generation;
+    cardSlot_t *slot = findSlot(hCard, &generation);
+    if (slot) slot->users.fetch_sub(1, memory_order_release);
+}
+
+// Retire a slot so that no new command can take its card, and wait for the commands still running on it
+// Returns the card to delete (NULL: not connected, or still in use after giving up the wait)
+static Cas::Card *retireSlot(cardSlot_t *slot, uint32_t generation, bool wait)
+{
+    uint32_t current = slot->generation.load();
+    do {
+        if ((current & 0xFFFF) != generation) return NULL;  // Stale handle, or already retired by another thread
+        if (!slot->card.load()) return NULL;
+    } while (!slot->generation.compare_exchange_weak(current, current + 1));
+
+    while (slot->users.load(memory_order_acquire)) {
+        if (!wait) return NULL;  // Leaked rather than deleted under a running command
+        this_thread::yield();
+    }
+    return slot->card.exchange(NULL);
+}
+
+static Cas::Card *detachCard(SCARDHANDLE hCard)
+{
+    uint32_t generation;
+    cardSlot_t *slot = findSlot(hCard, &generation);
+    if (!slot) return NULL;
+    return retireSlot(slot, generation, true);
+}
+
+// On unload, threads may have been terminated in the middle of a command, so the cards still held are not waited for
+static void releaseAllCards(void)
+{
+    for (int i = 0; i < CARD_HANDLE_COUNT; i++) {
+        delete retireSlot(&cards[i], cards[i].generation.load() & 0xFFFF, false);
+    }
+}
+
+//
+//
+// Block until SCardCancel() is called or the timeout expires (INFINITE: no timeout)
+// Returns true if cancelled; the cancel request is consumed by the first waiter that sees it
+static bool waitForCancel(DWORD dwTimeout)
+{
+    unique_lock<mutex> lock(cancelLock);
+    auto cancelled = [] { return isSCardCancelCalled.load(); };
+    if (dwTimeout == INFINITE) {
+        cancelEvent.wait(lock, cancelled);
+    } else if (!cancelEvent.wait_for(lock, chrono::milliseconds(dwTimeout), cancelled)) {
+        return false;
+    }
+    isSCardCancelCalled = false;
+    return true;
+}
 
 //
 //
@@ -54,14 +171,16 @@ BOOL WINAPI DllMain(HINSTANCE hinstDLL, DWORD fdwReason, LPVOID lpvReserved)
             break;
 
         case DLL_PROCESS_DETACH:
-            sys.INS = INS_OPEN;
+            ctx.INS = INS_OPEN;
             Log::logout_timestamp();
             Log::logout("[API: DLL_PROCESS_DETACH]\n\n");
             Log::logout(NULL);
 
             CloseHandle(h_SCardStartedEvent);
-            delete card;
-            card = NULL;
+            releaseAllCards();
+            sys.imageWriter.stop();  // Write any pending card image update
+            Capture::close();
+            Log::shutdown();         // Write the remaining log output
             break;
 
         default:
@@ -75,13 +194,15 @@ void __attribute__((constructor)) SCardVCasInit(void) {
     SystemInit();
 }
 void __attribute__((destructor)) SCardVCasDestroy(void) {
-    sys.INS = INS_OPEN;
+    ctx.INS = INS_OPEN;
     Log::logout_timestamp();
     Log::logout("[API: DLL_PROCESS_DETACH]\n\n");
     Log::logout(NULL);
 
-    delete card;
-    card = NULL;
+    releaseAllCards();
+    sys.imageWriter.stop();  // Write any pending card image update
+    Capture::close();
+    Log::shutdown();         // Write the remaining log output
 }
 #endif
 
@@ -134,7 +255,11 @@ extern "C" {
         Log::logout(NULL);
     #endif
         // If SCardCancel() is called, SCardGetStatusChangeA/W() will return SCARD_E_CANCELLED
-        isSCardCancelCalled = true;
+        {
+            lock_guard<mutex> lock(cancelLock);
+            isSCardCancelCalled = true;
+        }
+        cancelEvent.notify_all();
         return SCARD_S_SUCCESS;
     }
 
@@ -154,9 +279,12 @@ extern "C" {
         Log::logout("\n");
         Log::logout(NULL);
 
-        if (card)  delete card;
-        card = new Cas::Card();
-        *phCard = (SCARDHANDLE)h_SCardStartedEvent;
+        // Each card handle gets its own card emulator object, so that multiple tuners can transmit concurrently
+        Cas::Card *card = new Cas::Card();
+        if (!attachCard(card, phCard)) {
+            delete card;
+            return SCARD_E_NO_MEMORY;
+        }
         *pdwActiveProtocol = SCARD_PROTOCOL_T1;
         return SCARD_S_SUCCESS;
     }
@@ -174,9 +302,12 @@ extern "C" {
         Log::logout("\n");
         Log::logout(NULL);
 
-        if (card)  delete card;
-        card = new Cas::Card();
-        *phCard = (SCARDHANDLE)h_SCardStartedEvent;
+        // Each card handle gets its own card emulator object, so that multiple tuners can transmit concurrently
+        Cas::Card *card = new Cas::Card();
+        if (!attachCard(card, phCard)) {
+            delete card;
+            return SCARD_E_NO_MEMORY;
+        }
         *pdwActiveProtocol = SCARD_PROTOCOL_T1;
         return SCARD_S_SUCCESS;
     }
@@ -206,10 +337,9 @@ extern "C" {
         Log::logout("\n");
         Log::logout(NULL);
 
-        if (card)  {
-            delete card;
-            card = NULL;
-        }
+        Cas::Card *card = detachCard(hCard);
+        if (!card) return SCARD_E_INVALID_HANDLE;
+        delete card;
         return SCARD_S_SUCCESS;
     }
 
@@ -283,13 +413,14 @@ extern "C" {
         // sleep indefinitely if the timeout value is INFINITE
         if (rgReaderStates->dwCurrentState == rgReaderStates->dwEventState && dwTimeout > 0) {
             // If SCardCancel() is called, return SCARD_E_CANCELLED without changing the state
-            for (DWORD i = 0; i < dwTimeout; i++) {
-                Sleep(1);
-                if (isSCardCancelCalled) {
-                    isSCardCancelCalled = false;
-                    rgReaderStates->dwEventState &= ~SCARD_STATE_CHANGED;
-                    return SCARD_E_CANCELLED;
-                }
+            if (waitForCancel(dwTimeout)) {
+                rgReaderStates->dwEventState &= ~SCARD_STATE_CHANGED;
+    #ifdef ALLLOG
+                Log::logout("    SCARD_E_CANCELLED\n");
+                Log::logout("\n");
+                Log::logout(NULL);
+    #endif
+                return SCARD_E_CANCELLED;
             }
             // If timeout occurs, return SCARD_E_TIMEOUT without changing the state
             rgReaderStates->dwEventState &= ~SCARD_STATE_CHANGED;
@@ -332,13 +463,14 @@ extern "C" {
         // sleep indefinitely if the timeout value is INFINITE
         if (rgReaderStates->dwCurrentState == rgReaderStates->dwEventState && dwTimeout > 0) {
             // If SCardCancel() is called, return SCARD_E_CANCELLED without changing the state
-            for (DWORD i = 0; i < dwTimeout; i++) {
-                Sleep(1);
-                if (isSCardCancelCalled) {
-                    isSCardCancelCalled = false;
-                    rgReaderStates->dwEventState &= ~SCARD_STATE_CHANGED;
-                    return SCARD_E_CANCELLED;
-                }
+            if (waitForCancel(dwTimeout)) {
+                rgReaderStates->dwEventState &= ~SCARD_STATE_CHANGED;
+    #ifdef ALLLOG
+                Log::logout("    SCARD_E_CANCELLED\n");
+                Log::logout("\n");
+                Log::logout(NULL);
+    #endif
+                return SCARD_E_CANCELLED;
             }
             // If timeout occurs, return SCARD_E_TIMEOUT without changing the state
             rgReaderStates->dwEventState &= ~SCARD_STATE_CHANGED;
@@ -540,6 +672,7 @@ extern "C" {
     {
         Log::logout_timestamp();
         Log::logout("[API: SCardReconnect]\n\n");
+        Log::logout(NULL);
         if (pdwActiveProtocol) *pdwActiveProtocol = SCARD_PROTOCOL_T1;
         return SCARD_S_SUCCESS;
     }
@@ -627,11 +760,21 @@ extern "C" {
     LONG WINAPI SCardTransmit(SCARDHANDLE hCard, LPCSCARD_IO_REQUEST pioSendPci, LPCBYTE pbSendBuffer, DWORD cbSendLength, LPSCARD_IO_REQUEST pioRecvPci, LPBYTE pbRecvBuffer, LPDWORD pcbRecvLength)
     {
         bool CommandExecuted = false;
-        sys.INS = 0x00;
+        ctx.INS = 0x00;
+
+        Cas::Card *card = acquireCard(hCard);
+        if (!card) {
+            Log::logout_send_raw_data((const void *)pbSendBuffer, (uint16_t)cbSendLength);
+            Log::logout("    SCardTransmit() : Invalid card handle (hCard: 0x%016llx)\n\n", (uint64_t)hCard);
+            Log::logout(NULL);
+            return SCARD_E_INVALID_HANDLE;
+        }
 
         if (cbSendLength < 4) {
             Log::logout_send_raw_data((const void *)pbSendBuffer, (uint16_t)cbSendLength);
-            Log::logout("    SCardTransmit() : Data length is less than 4 bytes (SendLength: %lu)\n", cbSendLength);
+            Log::logout("    SCardTransmit() : Data length is less than 4 bytes (SendLength: %lu)\n\n", cbSendLength);
+            Log::logout(NULL);
+            releaseCard(hCard);
             if (*pcbRecvLength >= 2) {
                 *pcbRecvLength = 2;
                 st_be16(pbRecvBuffer, 0x6700);
@@ -642,7 +785,9 @@ extern "C" {
 
         if (*pcbRecvLength < 2) {
             Log::logout_send_raw_data((const void *)pbSendBuffer, (uint16_t)cbSendLength);
-            Log::logout("    SCardTransmit() : Receive buffer size is less than 2 bytes (RecvLength: %lu)\n", *pcbRecvLength);
+            Log::logout("    SCardTransmit() : Receive buffer size is less than 2 bytes (RecvLength: %lu)\n\n", *pcbRecvLength);
+            Log::logout(NULL);
+            releaseCard(hCard);
             return SCARD_E_INVALID_PARAMETER;
         }
 
@@ -650,7 +795,9 @@ extern "C" {
         LONG result = SCARD_S_SUCCESS;
         uint8_t Cla = pbSendBuffer[0];
         uint8_t Ins = pbSendBuffer[1];
-        sys.INS = (Cla == 0x90) ? Ins : 0;
+        ctx.INS = (Cla == 0x90) ? Ins : 0;
+        bool capture = sys.captureEnable || Log::binaryEnable[ ctx.INS ];  // APDU capture or binary log
+        uint64_t captureTime = capture ? Capture::timestamp() : 0;
         Log::logout_send_raw_data((const void *)pbSendBuffer, (uint16_t)cbSendLength);
 
         // Execute INS command
@@ -747,7 +894,9 @@ extern "C" {
         }
 
         card->saveCardImage();  // Update card image
+        releaseCard(hCard);
         Log::logout_receive_raw_data((const void *)pbRecvBuffer, (uint16_t)*pcbRecvLength);  // Receive data log
+        if (capture) Capture::record(pbSendBuffer, cbSendLength, pbRecvBuffer, *pcbRecvLength, captureTime);
 
         return result;
     }
@@ -763,24 +912,29 @@ static bool SystemInit()
 #endif
 {
     // Initialize global variables
-    sys.INS = 0;
+    ctx.INS = 0;
     sys.keySets.clear();
     sys.cardVersion = 2;
-    sys.logMode = 0;
+    Log::set_mode(0);  // Log mode (0: disable, 1: all, 2: EMM, 4: EMG, 8: EMD, 16: ECM, 32: CHK, 64: startup, 128: other, +256: binary log)
     sys.clModeEnable = true;
+    sys.imageWriteDelay = 1000;
+    sys.captureEnable = false;
+    Crypto::select_kernels();  // Bind the fastest crypto kernels for this CPU
 #ifdef _WIN32
     sys.CARD_IMAGE_FILE_NAME = Utils::get_dll_file_name(hinstDLL).append(".bin");
     sys.LOG_FILE_NAME = Utils::get_dll_file_name(hinstDLL).append(".log");
+    sys.CAPTURE_FILE_NAME = Utils::get_dll_file_name(hinstDLL).append(".trc");
 #else
     sys.CARD_IMAGE_FILE_NAME = "/var/lib/cobaltcas/cobaltcas.bin";
     sys.LOG_FILE_NAME = "/var/lib/cobaltcas/cobaltcas.log";
-    if (sys.logMode != 0 || !sys.clModeEnable) {
+    sys.CAPTURE_FILE_NAME = "/var/lib/cobaltcas/cobaltcas.trc";
+    if (sys.logMode != 0 || !sys.clModeEnable || sys.captureEnable) {
         mkdir("/var/lib/cobaltcas", 0755);
     }
 #endif
 
     // Initialization log output
-    sys.INS = INS_OPEN;
+    ctx.INS = INS_OPEN;
     Log::logout_timestamp();
     Log::logout("[API: DLL_PROCESS_ATTACH]\n");
     Log::logout("    Card version number       : 0x%02X\n", sys.cardVersion);
@@ -815,7 +969,13 @@ static bool SystemInit()
             Log::logout("                                * Writing to the card image file is only available to root\n");
         }
 #endif
+        Log::logout("    Card image write delay    : %u ms\n", sys.imageWriteDelay);
+    }
+    if (sys.captureEnable) {
+        Log::logout("    APDU capture              : %s\n", string(sys.CAPTURE_FILE_NAME).c_str());
     }
+    Log::logout("    Crypto kernel             : 0x00/0x04 %s, 0x40/0x44 %s (CPU: %s)\n",
+                Crypto::kernel_name(0x00), Crypto::kernel_name(0x40), Crypto::cpu_features());
     Log::logout("\n");
     Log::logout(NULL);  // Flush the log file stream
 
@@ -0,0 +1,111 @@
+// APDU replay tool
+// Loads the CobaltCas shared library, sends the commands of a trace file (captured with sys.captureEnable or made by
+// traffic_gen) through SCardTransmit and checks that the responses are byte-identical to the recorded ones
+// Reports per-INS latency percentiles and the total throughput
+// The card image must be in the state it had when the trace was recorded (for traffic_gen: a fresh default image)
+// Run with: apdu_replay library trace.trc [repeat]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <vector>
+#include "pcsc_loader.h"
+#include "trace.h"
+
+using namespace std;
+
+//------------------------------------------------------------------------------
+static double percentile(const vector<double> &sorted, double p)
+{
+    size_t i = (size_t)(p * (sorted.size() - 1) + 0.5);
+    return sorted[ i ];
+}
+
+//==============================================================================
+int main(int argc, char *argv[])
+{
+    if (argc < 3) {
+        fprintf(stderr, "Usage: apdu_replay library trace.trc [repeat]\n");
+        return 1;
+    }
+    int repeat = (argc > 3) ? atoi(argv[3]) : 1;
+
+    FILE *fp = fopen(argv[2], "rb");
+    if (!fp || !Trace::read_header(fp)) {
+        fprintf(stderr, "Not a trace file: %s\n", argv[2]);
+        return 1;
+    }
+    vector<Trace::APDU_t> apdus;
+    Trace::APDU_t a;
+    while (Trace::read_record(fp, &a)) apdus.push_back(a);
+    fclose(fp);
+
+    if (!load_pcsc_library(argv[1])) {
+        fprintf(stderr, "Cannot load the PC/SC functions from %s\n", argv[1]);
+        return 1;
+    }
+
+    SCARDCONTEXT hContext;
+    if (pSCardEstablishContext(SCARD_SCOPE_USER, NULL, NULL, &hContext) != SCARD_S_SUCCESS) {
+        fprintf(stderr, "SCardEstablishContext failed\n");
+        return 1;
+    }
+
+    // Each thread of the capture gets a card handle of its own, like a tuner does
+    map<uint32_t, SCARDHANDLE> handles;
+    map<uint8_t, vector<double> > latency;  // INS -> us
+    map<uint8_t, uint32_t> mismatch;
+    uint32_t mismatchTotal = 0;
+
+    auto start = chrono::steady_clock::now();
+    for (int r = 0; r < repeat; r++) {
+        for (const Trace::APDU_t &apdu : apdus) {
+            if (!handles.count(apdu.threadID)) {
+                SCARDHANDLE hCard;
+                DWORD protocol;
+                if (pSCardConnect(hContext, "CobaltCas", SCARD_SHARE_SHARED, SCARD_PROTOCOL_T1, &hCard, &protocol) != SCARD_S_SUCCESS) {
+                    fprintf(stderr, "SCardConnect failed\n");
+                    return 1;
+                }
+                handles[ apdu.threadID ] = hCard;
+            }
+
+            uint8_t res[ TRACE_APDU_MAX_LENGTH ];
+            DWORD resLength = sizeof(res);
+            uint8_t ins = apdu.command[ 1 ];
+            auto t0 = chrono::steady_clock::now();
+            LONG result = pSCardTransmit(handles[ apdu.threadID ], NULL, apdu.command, apdu.commandLength, NULL, res, &resLength);
+            auto t1 = chrono::steady_clock::now();
+            latency[ ins ].push_back(chrono::duration_cast<chrono::nanoseconds>(t1 - t0).count() / 1000.0);
+
+            if (apdu.responseLength && ((result != SCARD_S_SUCCESS) || (resLength != apdu.responseLength) || memcmp(res, apdu.response, resLength))) {
+                if (!mismatchTotal) {
+                    fprintf(stderr, "First mismatch at record %u (INS 0x%02X)\n", (unsigned)(&apdu - apdus.data()), ins);
+                }
+                mismatch[ ins ]++;
+                mismatchTotal++;
+            }
+        }
+    }
+    double seconds = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count() / 1e9;
+
+    for (auto &h : handles) pSCardDisconnect(h.second, SCARD_LEAVE_CARD);
+    pSCardReleaseContext(hContext);
+
+    printf("INS    count  mismatch    p50 us    p90 us    p99 us    max us\n");
+    uint64_t total = 0;
+    for (auto &l : latency) {
+        vector<double> &v = l.second;
+        sort(v.begin(), v.end());
+        printf("0x%02X %7u %9u %9.2f %9.2f %9.2f %9.2f\n", l.first, (unsigned)v.size(), mismatch[ l.first ],
+               percentile(v, 0.50), percentile(v, 0.90), percentile(v, 0.99), v.back());
+        total += v.size();
+    }
+    printf("\n%llu commands in %.3f s: %.0f commands/s, %u mismatched responses\n",
+           (unsigned long long)total, seconds, (seconds > 0) ? total / seconds : 0.0, mismatchTotal);
+
+    return mismatchTotal ? 2 : 0;
+}
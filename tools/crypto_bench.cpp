@@ -0,0 +1,114 @@
+// Crypto microbenchmark
+// Measures Crypto::encrypt/decrypt/digest for every protocol number over ECM/EMM-sized messages and bulk buffers
+// Run with: meson test --benchmark (or directly: crypto_bench [min_ms_per_case])
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include "crypto.h"
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define HAVE_TSC
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#endif
+
+using namespace std;
+
+static const uint8_t PROTOCOLS[] = { 0x00, 0x04, 0x40, 0x44 };
+static const uint32_t LENGTHS[] = { 30, 46, 62, 78, 94, 118, 1024, 16384 };  // ECM/EMM payload sizes, then bulk sizes
+
+static volatile uint32_t sink;  // Keeps the results alive
+
+//------------------------------------------------------------------------------
+// Ratio between the TSC and the wall clock (0 if no TSC)
+static double measure_cycles_per_ns(void)
+{
+#ifdef HAVE_TSC
+    auto start = chrono::steady_clock::now();
+    uint64_t tsc = __rdtsc();
+    while (chrono::steady_clock::now() - start < chrono::milliseconds(50));
+    uint64_t cycles = __rdtsc() - tsc;
+    double ns = (double)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+    return cycles / ns;
+#else
+    return 0;
+#endif
+}
+
+//------------------------------------------------------------------------------
+// Run op until at least minTime has passed, three times, and return the best time per call in ns
+template <class OP>
+static double measure(OP op, chrono::milliseconds minTime)
+{
+    double best = 0;
+    for (int round = 0; round < 3; round++) {
+        uint64_t count = 0;
+        auto start = chrono::steady_clock::now();
+        auto elapsed = chrono::steady_clock::duration::zero();
+        do {
+            for (int i = 0; i < 16; i++) op();
+            count += 16;
+            elapsed = chrono::steady_clock::now() - start;
+        } while (elapsed < minTime);
+        double ns = (double)chrono::duration_cast<chrono::nanoseconds>(elapsed).count() / count;
+        if ((round == 0) || (ns < best)) best = ns;
+    }
+    return best;
+}
+
+//------------------------------------------------------------------------------
+static void report(uint8_t protocol, const char *op, uint32_t len, double ns, double cyclesPerNs)
+{
+    printf("0x%02X   %-8s %6u %10.1f ", protocol, op, len, ns);
+    if (cyclesPerNs > 0) {
+        printf("%10.2f ", ns * cyclesPerNs / len);
+    } else {
+        printf("%10s ", "-");
+    }
+    printf("%12.0f\n", 1e9 / ns);
+}
+
+//==============================================================================
+int main(int argc, char *argv[])
+{
+    chrono::milliseconds minTime(argc > 1 ? atoi(argv[1]) : 20);
+
+    Crypto::select_kernels();
+    double cyclesPerNs = measure_cycles_per_ns();
+
+    printf("CobaltCas crypto benchmark\n");
+    printf("Kernels: 0x00/0x04 %s, 0x40/0x44 %s (CPU: %s)\n",
+           Crypto::kernel_name(0x00), Crypto::kernel_name(0x40), Crypto::cpu_features());
+    if (cyclesPerNs > 0) {
+        printf("TSC: %.2f GHz (cycles/B counts TSC cycles)\n", cyclesPerNs);
+    } else {
+        printf("TSC: not available (cycles/B not reported)\n");
+    }
+    printf("\n");
+    printf("proto  op        bytes      ns/op   cycles/B   ops/s/core\n");
+
+    static uint8_t in[ 16384 ], out[ 16384 ];
+    for (size_t i = 0; i < sizeof(in); i++) in[ i ] = (uint8_t)(i * 131 + 7);
+
+    for (uint8_t protocol : PROTOCOLS) {
+        Crypto::KeyContext kc;
+        Crypto::init_key(&kc, 0x0123456789abcdefLL, protocol);
+        for (uint32_t len : LENGTHS) {
+            double ns;
+            ns = measure([&] { Crypto::encrypt(out, in, len, kc); }, minTime);
+            report(protocol, "encrypt", len, ns, cyclesPerNs);
+            ns = measure([&] { Crypto::decrypt(out, in, len, kc); }, minTime);
+            report(protocol, "decrypt", len, ns, cyclesPerNs);
+            ns = measure([&] { sink = Crypto::digest(kc, in, len); }, minTime);
+            report(protocol, "digest", len, ns, cyclesPerNs);
+        }
+        printf("\n");
+    }
+
+    return 0;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+// Resolves the PC/SC entry points of a CobaltCas build at run time, so the tools can be pointed at any build of the library
+// (linking against it would bind whichever libpcsclite comes first in the search path instead)
+
+#include <stdio.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <winscard.h>
+#define SCARD_CONNECT_NAME "SCardConnectA"
+#else
+#include <dlfcn.h>
+#include <PCSC/winscard.h>
+#define WINAPI
+#define SCARD_CONNECT_NAME "SCardConnect"
+#endif
+
+static LONG (WINAPI *pSCardEstablishContext)(DWORD dwScope, LPCVOID pvReserved1, LPCVOID pvReserved2, LPSCARDCONTEXT phContext);
+static LONG (WINAPI *pSCardReleaseContext)(SCARDCONTEXT hContext);
+static LONG (WINAPI *pSCardConnect)(SCARDCONTEXT hContext, LPCSTR szReader, DWORD dwShareMode, DWORD dwPreferredProtocols, LPSCARDHANDLE phCard, LPDWORD pdwActiveProtocol);
+static LONG (WINAPI *pSCardDisconnect)(SCARDHANDLE hCard, DWORD dwDisposition);
+static LONG (WINAPI *pSCardTransmit)(SCARDHANDLE hCard, LPCSCARD_IO_REQUEST pioSendPci, LPCBYTE pbSendBuffer, DWORD cbSendLength,
+                                     LPSCARD_IO_REQUEST pioRecvPci, LPBYTE pbRecvBuffer, LPDWORD pcbRecvLength);
+
+static bool load_pcsc_library(const char *name)
+{
+#ifdef _WIN32
+    HMODULE h = LoadLibraryA(name);
+    if (!h) return false;
+#define LOAD(f, n) (f = (decltype(f))GetProcAddress(h, n))
+#else
+    void *h = dlopen(name, RTLD_NOW | RTLD_LOCAL);
+    if (!h) {
+        fprintf(stderr, "%s\n", dlerror());
+        return false;
+    }
+#define LOAD(f, n) (f = (decltype(f))dlsym(h, n))
+#endif
+    return LOAD(pSCardEstablishContext, "SCardEstablishContext") && LOAD(pSCardReleaseContext, "SCardReleaseContext") &&
+           LOAD(pSCardConnect, SCARD_CONNECT_NAME) && LOAD(pSCardDisconnect, "SCardDisconnect") &&
+           LOAD(pSCardTransmit, "SCardTransmit");
+#undef LOAD
+}
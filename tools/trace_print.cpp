@@ -0,0 +1,102 @@
+// Binary log pretty-printer
+// Renders a trace file written with LOG_BINARY (or the APDU capture) as the text log the library would have written
+// The commands are run again through the emulator linked into this tool with text logging enabled, so the per-command
+// field decoding, contract bitmaps and card image address names come from the same code as the live log
+// Each command is preceded by its recorded time, thread, latency and return code
+// The card state is rebuilt from the default card image (CL mode), so the decoded fields only match when the log holds
+// every command since the library was loaded (LOG_BINARY | LOG_ALL)
+// The binary log is appended to by every library load: a timestamp going back starts a new session with new card handles
+// Run with: trace_print trace.trc output.log [log mode]  (log mode selects the commands to render, default 1: all)
+
+#include "project.h"
+#ifndef _WIN32
+#include <PCSC/winscard.h>
+#endif
+#include <map>
+#include "trace.h"
+
+//==============================================================================
+int main(int argc, char *argv[])
+{
+    if (argc < 3) {
+        fprintf(stderr, "Usage: trace_print trace.trc output.log [log mode]\n");
+        return 1;
+    }
+    uint16_t logMode = (argc > 3) ? (uint16_t)strtoul(argv[3], NULL, 0) : LOG_ALL;
+
+    FILE *fp = fopen(argv[1], "rb");
+    if (!fp || !Trace::read_header(fp)) {
+        fprintf(stderr, "Not a trace file: %s\n", argv[1]);
+        return 1;
+    }
+
+    FILE *out = fopen(argv[2], "w");
+    if (!out) {
+        fprintf(stderr, "Cannot create %s\n", argv[2]);
+        return 1;
+    }
+    fclose(out);
+
+    // SystemInit() has already run from the library constructor: redirect the text log and keep the card image in memory
+    sys.LOG_FILE_NAME = argv[2];
+    sys.clModeEnable = true;
+    sys.captureEnable = false;
+    Log::set_mode(logMode & ~LOG_BINARY);
+
+    SCARDCONTEXT hContext;
+    if (SCardEstablishContext(SCARD_SCOPE_USER, NULL, NULL, &hContext) != SCARD_S_SUCCESS) {
+        fprintf(stderr, "SCardEstablishContext failed\n");
+        return 1;
+    }
+
+    // Each thread of the log gets a card handle of its own, like the tuner that sent the commands
+    map<uint32_t, SCARDHANDLE> handles;
+    uint32_t count = 0;
+    uint32_t mismatch = 0;
+    uint64_t lastTimestamp = 0;
+    Trace::APDU_t a;
+    while (Trace::read_record(fp, &a)) {
+        if (a.timestamp < lastTimestamp) {
+            for (auto &h : handles) SCardDisconnect(h.second, SCARD_LEAVE_CARD);
+            handles.clear();
+        }
+        lastTimestamp = a.timestamp;
+
+        if (!handles.count(a.threadID)) {
+            SCARDHANDLE hCard;
+            DWORD protocol;
+            if (SCardConnect(hContext, "CobaltCas", SCARD_SHARE_SHARED, SCARD_PROTOCOL_T1, &hCard, &protocol) != SCARD_S_SUCCESS) {
+                fprintf(stderr, "SCardConnect failed\n");
+                return 1;
+            }
+            handles[ a.threadID ] = hCard;
+        }
+
+        ctx.INS = a.ins;
+        Log::logout("[Record %u: +%.6f s, thread %u, latency %.2f us, return code 0x%04X]\n",
+                    count, a.timestamp / 1e9, a.threadID, a.latency / 1000.0, a.returnCode);
+
+        uint8_t res[ TRACE_APDU_MAX_LENGTH ];
+        DWORD resLength = sizeof(res);
+        SCardTransmit(handles[ a.threadID ], NULL, a.command, a.commandLength, NULL, res, &resLength);
+
+        if (a.responseLength && ((resLength != a.responseLength) || memcmp(res, a.response, resLength))) {
+            ctx.INS = a.ins;
+            Log::logout("    * Recorded response differs (the card state is not the one of the log): ");
+            Log::logout_command_dump(a.response, a.responseLength);
+            Log::logout("\n\n");
+            Log::logout(NULL);
+            mismatch++;
+        }
+        count++;
+        Log::flush();  // The log of a whole trace does not fit in the log buffer, which drops what the writer thread cannot keep up with
+    }
+    fclose(fp);
+
+    for (auto &h : handles) SCardDisconnect(h.second, SCARD_LEAVE_CARD);
+    SCardReleaseContext(hContext);
+    Log::shutdown();
+
+    printf("%u records rendered to %s, %u recorded responses differ\n", count, argv[2], mismatch);
+    return mismatch ? 2 : 0;
+}
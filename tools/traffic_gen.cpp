@@ -0,0 +1,426 @@
+// Synthetic traffic generator
+// Builds correctly encrypted and MAC'd ECM/EMM/EMG/CHK commands addressed to the default card image and writes them to an APDU trace file
+// The trace starts with INT/IDI and one EMM per broadcast group that installs the test work keys and contract bitmap,
+// so it can be replayed against a freshly created card image and every command is accepted
+// Run with: traffic_gen [options] output.trc  (see usage())
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <random>
+#include <string>
+#include <vector>
+#include "project.h"
+#include "card.h"
+#include "default_card_image.h"
+#include "ldst.h"
+#include "trace.h"
+
+static const uint64_t TEST_WORK_KEY = 0x0123456789abcdefLL;  // Work key ID 0; ID 1 uses the inverted key, every group its own variant
+static const uint16_t TEST_DATE = 0xef90;                     // Date carried by the ECM/CHK (MJD)
+static const uint16_t TEST_EXPIRY_DATE = 0xffff;              // Contract expiry date installed by the EMM (MJD)
+static const uint8_t TEST_BITMAP[ 32 ] = {
+    0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01, 0xff, 0x00, 0xff, 0x00, 0xff, 0x00, 0xff, 0x00,
+    0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01, 0xff, 0x00, 0xff, 0x00, 0xff, 0x00, 0xff, 0x00,
+};
+
+enum { CMD_ECM, CMD_EMM, CMD_EMG, CMD_CHK, CMD_COUNT };
+static const uint8_t CMD_INS[ CMD_COUNT ] = { INS_ECM, INS_EMM, INS_EMG, INS_CHK };
+static const char *CMD_NAME[ CMD_COUNT ] = { "ECM", "EMM", "EMG", "CHK" };
+
+typedef vector<uint8_t> NANO_SET_t;
+
+typedef struct {
+    uint32_t count;
+    uint8_t protocol;
+    vector<uint8_t> bgIDs;
+    uint32_t weight[ CMD_COUNT ];
+    vector<NANO_SET_t> ecmNanos;
+    vector<NANO_SET_t> emmNanos;
+    uint32_t ecmRepeat;
+    uint32_t seed;
+    uint8_t cardVersion;
+    const char *output;
+} OPTIONS_t;
+
+static const Cas::INFO_t *info = (const Cas::INFO_t *)&Cas::DEFAULT_CARD_IMAGE[ INFO_ADDR ];
+static mt19937 rng;
+
+//------------------------------------------------------------------------------
+static void usage(void)
+{
+    fprintf(stderr,
+        "Usage: traffic_gen [options] output.trc\n"
+        "  -n count      Number of ECM/EMM/EMG/CHK commands after the setup (default 10000)\n"
+        "  -p protocol   Protocol number 0x00/0x04/0x40/0x44 (default 0x00)\n"
+        "  -g ids        Broadcast group IDs, comma separated (default 0x01)\n"
+        "  -w weights    Relative frequency of ECM:EMM:EMG:CHK (default 100:5:1:1)\n"
+        "  -e nanos      ECM function numbers, e.g. 52,51/21,23 (sets separated by '/' are picked at random; default 52)\n"
+        "  -m nanos      EMM function numbers, same syntax (default 10,11)\n"
+        "  -r repeat     Number of times each ECM is sent before its scrambling keys change (default 1)\n"
+        "  -s seed       Random seed (default 1)\n"
+        "  -v version    Card version the EMG falsification detection code is built for (default 2)\n"
+        "Function numbers: 10 (work key), 11 (contract bitmap), 21 (multi-function), 23 (invalidate tier by card ID),\n"
+        "                  51 (trial viewing), 52 (contract check)\n");
+    exit(1);
+}
+
+//------------------------------------------------------------------------------
+static vector<uint8_t> parse_list(const char *s)
+{
+    vector<uint8_t> list;
+    for (const char *p = s; *p;) {
+        char *end;
+        list.push_back((uint8_t)strtoul(p, &end, 16));
+        if (end == p) usage();
+        p = (*end == ',') ? end + 1 : end;
+    }
+    return list;
+}
+
+//------------------------------------------------------------------------------
+static vector<NANO_SET_t> parse_nano_sets(const char *s)
+{
+    vector<NANO_SET_t> sets;
+    string str(s);
+    size_t start = 0;
+    while (true) {
+        size_t end = str.find('/', start);
+        sets.push_back(parse_list(str.substr(start, end - start).c_str()));
+        if (end == string::npos) break;
+        start = end + 1;
+    }
+    return sets;
+}
+
+//------------------------------------------------------------------------------
+static uint64_t test_work_key(uint8_t bgID, uint8_t workKeyID)
+{
+    uint64_t key = TEST_WORK_KEY ^ ((uint64_t)bgID << 56);
+    return (workKeyID & 0x01) ? ~key : key;
+}
+
+//------------------------------------------------------------------------------
+// Append a function with contents that keep the card in the state set up at the start of the trace
+static void append_nano(vector<uint8_t> &d, uint8_t nano, uint8_t bgID, uint8_t ins)
+{
+    d.push_back(nano);
+    switch (nano) {
+        case 0x10:  // Update work key (the key the card already has for the ID)
+        {
+            uint8_t workKeyID = (uint8_t)(rng() & 0x01);
+            d.push_back(9);
+            d.push_back(workKeyID);
+            d.resize(d.size() + 8);
+            st_be64(&d[ d.size() - 8 ], test_work_key(bgID, workKeyID));
+            break;
+        }
+
+        case 0x11:  // Update contract bit flag
+        case 0x52:  // Check contract bit flag
+            d.push_back(sizeof(TEST_BITMAP));
+            d.insert(d.end(), TEST_BITMAP, TEST_BITMAP + sizeof(TEST_BITMAP));
+            break;
+
+        case 0x21:  // Multi-function: reset update numbers (EMM) / reset trial viewing (ignored by the ECM)
+            d.push_back(1);
+            d.push_back((ins == INS_EMM) ? 0x02 : 0xff);
+            break;
+
+        case 0x23:  // Invalidate tier, addressed to another card
+            d.push_back(6);
+            d.resize(d.size() + 6);
+            st_be48(&d[ d.size() - 6 ], ~ld_be48(info->ID) & 0xffffffffffffLL);
+            break;
+
+        case 0x51:  // Start trial viewing (ignored while the contract is active)
+            d.push_back(1);
+            d.push_back(7);
+            break;
+
+        default:
+            d.push_back(0);
+            break;
+    }
+}
+
+//------------------------------------------------------------------------------
+// Append the falsification detection code over d[ macStart ~ ] and encrypt d[ encStart ~ ] including the code
+static void seal(vector<uint8_t> &d, size_t macStart, size_t encStart, uint64_t key, uint8_t protocol)
+{
+    Crypto::KeyContext kc;
+    Crypto::init_key(&kc, key, protocol);
+
+    d.resize(d.size() + 4);
+    st_be32(&d[ d.size() - 4 ], Crypto::digest(kc, &d[ macStart ], (uint32_t)(d.size() - 4 - macStart)));
+    Crypto::encrypt(&d[ encStart ], &d[ encStart ], (uint32_t)(d.size() - encStart), kc);
+}
+
+//------------------------------------------------------------------------------
+static Trace::APDU_t make_apdu(uint8_t ins, const vector<uint8_t> &data)
+{
+    if (data.size() > ECM_DATA_MAX_LENGTH) {
+        fprintf(stderr, "Command data too long (INS 0x%02X, %u bytes): use fewer functions\n", ins, (unsigned)data.size());
+        exit(1);
+    }
+
+    Trace::APDU_t a;
+    memset(&a, 0x00, sizeof(a));
+    uint8_t header[] = { 0x90, ins, 0x00, 0x00, (uint8_t)data.size() };
+    memcpy(a.command, header, sizeof(header));
+    memcpy(a.command + sizeof(header), data.data(), data.size());
+    a.commandLength = (uint16_t)(sizeof(header) + data.size() + 1);  // Le: 0x00
+    a.ins = ins;
+    return a;
+}
+
+//------------------------------------------------------------------------------
+// Command without data (INT/IDI)
+static Trace::APDU_t make_simple_apdu(uint8_t ins)
+{
+    Trace::APDU_t a;
+    memset(&a, 0x00, sizeof(a));
+    uint8_t command[] = { 0x90, ins, 0x00, 0x00, 0x00 };
+    memcpy(a.command, command, sizeof(command));
+    a.commandLength = sizeof(command);
+    a.ins = ins;
+    return a;
+}
+
+//------------------------------------------------------------------------------
+static Trace::APDU_t make_ecm(const OPTIONS_t &opt, uint8_t bgID, const NANO_SET_t &nanos, const uint8_t scramblingKeys[ 16 ], uint32_t seq)
+{
+    uint8_t workKeyID = (uint8_t)((seq >> 4) & 0x01);
+    bool check = false;
+    for (uint8_t nano : nanos) check |= (nano == 0x52);
+
+    vector<uint8_t> d = { opt.protocol, bgID, workKeyID };
+    d.insert(d.end(), scramblingKeys, scramblingKeys + 16);  // Odd / even scrambling key
+    d.push_back(check ? 0x02 : 0x01);                        // Judgment type: contract check or free
+    d.push_back((uint8_t)(TEST_DATE >> 8));
+    d.push_back((uint8_t)TEST_DATE);
+    uint32_t sec = seq % 86400;
+    d.push_back((uint8_t)((sec / 36000) << 4 | (sec / 3600) % 10));  // Time (BCD)
+    d.push_back((uint8_t)(((sec / 600) % 6) << 4 | (sec / 60) % 10));
+    d.push_back((uint8_t)(((sec / 10) % 6) << 4 | sec % 10));
+    d.push_back(0x01);                                       // Recording control
+    for (uint8_t nano : nanos) append_nano(d, nano, bgID, INS_ECM);
+
+    seal(d, 0, 3, test_work_key(bgID, workKeyID), opt.protocol);
+    return make_apdu(INS_ECM, d);
+}
+
+//------------------------------------------------------------------------------
+static Trace::APDU_t make_emm(const OPTIONS_t &opt, uint8_t bgID, const NANO_SET_t &nanos)
+{
+    vector<uint8_t> d(info->ID, info->ID + 6);
+    d.push_back(0);  // Length (filled in below)
+    d.push_back(opt.protocol);
+    d.push_back(bgID);
+    d.push_back(0xc0);  // Update number 0xC000: always applied
+    d.push_back(0x00);
+    d.push_back((uint8_t)(TEST_EXPIRY_DATE >> 8));
+    d.push_back((uint8_t)TEST_EXPIRY_DATE);
+    for (uint8_t nano : nanos) append_nano(d, nano, bgID, INS_EMM);
+    d[ 6 ] = (uint8_t)(d.size() - 7 + 4);
+
+    seal(d, 0, 8, ld_be64(info->Km), opt.protocol);
+    return make_apdu(INS_EMM, d);
+}
+
+//------------------------------------------------------------------------------
+// EMM that installs both test work keys and the contract bitmap for the group
+static Trace::APDU_t make_setup_emm(const OPTIONS_t &opt, uint8_t bgID)
+{
+    vector<uint8_t> d(info->ID, info->ID + 6);
+    d.push_back(0);
+    d.push_back(opt.protocol);
+    d.push_back(bgID);
+    d.push_back(0xc0);
+    d.push_back(0x00);
+    d.push_back((uint8_t)(TEST_EXPIRY_DATE >> 8));
+    d.push_back((uint8_t)TEST_EXPIRY_DATE);
+    for (uint8_t workKeyID = 0; workKeyID < 2; workKeyID++) {
+        d.push_back(0x10);
+        d.push_back(9);
+        d.push_back(workKeyID);
+        d.resize(d.size() + 8);
+        st_be64(&d[ d.size() - 8 ], test_work_key(bgID, workKeyID));
+    }
+    append_nano(d, 0x11, bgID, INS_EMM);
+    d[ 6 ] = (uint8_t)(d.size() - 7 + 4);
+
+    seal(d, 0, 8, ld_be64(info->Km), opt.protocol);
+    return make_apdu(INS_EMM, d);
+}
+
+//------------------------------------------------------------------------------
+static Trace::APDU_t make_emg(const OPTIONS_t &opt, uint8_t bgID, uint32_t seq)
+{
+    static const char text[] = "CobaltCas load test ";
+    uint16_t len = (uint16_t)(seq % 21);
+
+    vector<uint8_t> d(info->ID, info->ID + 6);
+    d.push_back(opt.protocol);
+    d.push_back(bgID);
+    d.push_back(0x01);  // Message control
+    d.push_back(0xc0);  // Update number 0xC000: always applied
+    d.push_back(0x00);
+    d.push_back((uint8_t)(TEST_EXPIRY_DATE >> 8));
+    d.push_back((uint8_t)TEST_EXPIRY_DATE);
+    d.push_back(0x00);  // Message template number
+    d.push_back((uint8_t)(1 + seq % 16));
+    d.push_back(0x01);  // Differential format number
+    d.push_back((uint8_t)(len >> 8));
+    d.push_back((uint8_t)len);
+    d.insert(d.end(), text, text + len);
+
+    seal(d, (opt.cardVersion < 3) ? 9 : 0, 9, ld_be64(info->Km), opt.protocol);
+    return make_apdu(INS_EMG, d);
+}
+
+//------------------------------------------------------------------------------
+static Trace::APDU_t make_chk(const OPTIONS_t &opt, uint8_t bgID, uint32_t seq)
+{
+    uint8_t workKeyID = (uint8_t)(seq & 0x01);
+    uint8_t protocol = opt.protocol | 0x01;
+
+    vector<uint8_t> d;
+    d.push_back((uint8_t)(TEST_DATE >> 8));
+    d.push_back((uint8_t)TEST_DATE);
+    d.push_back(protocol);
+    d.push_back(bgID);
+    d.push_back(workKeyID);
+    d.push_back(0x02);  // Judgment type: contract check
+    d.push_back(0x01);  // Recording control
+    d.push_back(0x00);
+    append_nano(d, 0x52, bgID, INS_CHK);
+
+    // The contract confirmation command has no falsification detection code
+    Crypto::KeyContext kc;
+    Crypto::init_key(&kc, test_work_key(bgID, workKeyID), protocol);
+    Crypto::encrypt(&d[ 5 ], &d[ 5 ], (uint32_t)(d.size() - 5), kc);
+    return make_apdu(INS_CHK, d);
+}
+
+//==============================================================================
+int main(int argc, char *argv[])
+{
+    OPTIONS_t opt;
+    opt.count = 10000;
+    opt.protocol = 0x00;
+    opt.bgIDs = { 0x01 };
+    opt.weight[ CMD_ECM ] = 100;
+    opt.weight[ CMD_EMM ] = 5;
+    opt.weight[ CMD_EMG ] = 1;
+    opt.weight[ CMD_CHK ] = 1;
+    opt.ecmNanos = { { 0x52 } };
+    opt.emmNanos = { { 0x10, 0x11 } };
+    opt.ecmRepeat = 1;
+    opt.seed = 1;
+    opt.cardVersion = 2;
+    opt.output = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[ i ];
+        if ((arg[0] != '-') || !arg[1]) {
+            opt.output = arg;
+            continue;
+        }
+        if (i + 1 >= argc) usage();
+        const char *val = argv[ ++i ];
+        switch (arg[1]) {
+            case 'n': opt.count = (uint32_t)strtoul(val, NULL, 0); break;
+            case 'p': opt.protocol = (uint8_t)strtoul(val, NULL, 16); break;
+            case 'g': opt.bgIDs = parse_list(val); break;
+            case 'w':
+                if (sscanf(val, "%u:%u:%u:%u", &opt.weight[ CMD_ECM ], &opt.weight[ CMD_EMM ], &opt.weight[ CMD_EMG ], &opt.weight[ CMD_CHK ]) != 4) usage();
+                break;
+            case 'e': opt.ecmNanos = parse_nano_sets(val); break;
+            case 'm': opt.emmNanos = parse_nano_sets(val); break;
+            case 'r': opt.ecmRepeat = (uint32_t)strtoul(val, NULL, 0); break;
+            case 's': opt.seed = (uint32_t)strtoul(val, NULL, 0); break;
+            case 'v': opt.cardVersion = (uint8_t)strtoul(val, NULL, 0); break;
+            default: usage();
+        }
+    }
+
+    uint32_t totalWeight = 0;
+    for (int c = 0; c < CMD_COUNT; c++) totalWeight += opt.weight[ c ];
+    if (!opt.output || opt.bgIDs.empty() || !totalWeight || !opt.ecmRepeat) usage();
+    if ((opt.protocol != 0x00) && (opt.protocol != 0x04) && (opt.protocol != 0x40) && (opt.protocol != 0x44)) usage();
+    for (uint8_t bgID : opt.bgIDs) {
+        if (bgID >= BGID_COUNT) usage();
+    }
+
+    FILE *fp = fopen(opt.output, "wb");
+    if (!fp) {
+        fprintf(stderr, "Cannot create %s\n", opt.output);
+        return 1;
+    }
+
+    rng.seed(opt.seed);
+    Crypto::select_kernels();
+
+    uint32_t sent[ CMD_COUNT ] = {};
+    uint64_t bytes = 0;
+    bool ok = Trace::write_header(fp);
+
+    // Setup: initial setting condition, card ID and the test keys/contract for every group
+    ok = ok && Trace::write_record(fp, make_simple_apdu(INS_INT));
+    ok = ok && Trace::write_record(fp, make_simple_apdu(INS_IDI));
+    for (uint8_t bgID : opt.bgIDs) {
+        ok = ok && Trace::write_record(fp, make_setup_emm(opt, bgID));
+    }
+
+    // Every group keeps its own ECM until the scrambling keys change
+    vector<uint8_t> keys(opt.bgIDs.size() * 16);
+    vector<uint32_t> ecmSent(opt.bgIDs.size(), 0);
+    vector<NANO_SET_t> ecmSet(opt.bgIDs.size());
+
+    for (uint32_t n = 0; ok && (n < opt.count); n++) {
+        uint32_t r = rng() % totalWeight;
+        int c = 0;
+        while (r >= opt.weight[ c ]) r -= opt.weight[ c++ ];
+
+        size_t g = rng() % opt.bgIDs.size();
+        uint8_t bgID = opt.bgIDs[ g ];
+
+        Trace::APDU_t a;
+        switch (c) {
+            case CMD_ECM:
+                if (ecmSent[ g ] % opt.ecmRepeat == 0) {
+                    for (int i = 0; i < 16; i++) keys[ g * 16 + i ] = (uint8_t)rng();
+                    ecmSet[ g ] = opt.ecmNanos[ rng() % opt.ecmNanos.size() ];
+                }
+                a = make_ecm(opt, bgID, ecmSet[ g ], &keys[ g * 16 ], ecmSent[ g ] / opt.ecmRepeat);
+                ecmSent[ g ]++;
+                break;
+            case CMD_EMM:
+                a = make_emm(opt, bgID, opt.emmNanos[ rng() % opt.emmNanos.size() ]);
+                break;
+            case CMD_EMG:
+                a = make_emg(opt, bgID, n);
+                break;
+            default:
+                a = make_chk(opt, bgID, n);
+                break;
+        }
+        ok = Trace::write_record(fp, a);
+        sent[ c ]++;
+        bytes += a.commandLength;
+    }
+
+    if (fclose(fp) != 0) ok = false;
+    if (!ok) {
+        fprintf(stderr, "Write error: %s\n", opt.output);
+        return 1;
+    }
+
+    printf("%s: %u commands, %llu bytes (protocol 0x%02X, %u groups)\n",
+           opt.output, opt.count, (unsigned long long)bytes, opt.protocol, (unsigned)opt.bgIDs.size());
+    for (int c = 0; c < CMD_COUNT; c++) {
+        printf("  %s (INS 0x%02X): %u\n", CMD_NAME[ c ], CMD_INS[ c ], sent[ c ]);
+    }
+    return 0;
+}
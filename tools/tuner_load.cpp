@@ -0,0 +1,331 @@
+// Multi-tuner load generator
+// Every thread emulates a tuner with its own PC/SC context and card handle: the setup commands, then an ECM every 100 ms of
+// broadcast time, a burst of EMMs and a CHK at longer intervals, with the broadcast clock sped up by a factor
+// The run is repeated for each tuner count, reporting the throughput and per-command latency percentiles, so the
+// point where the shared card state stops scaling shows up as flat throughput and a growing p99
+// The commands are taken from a trace made by traffic_gen; its leading INT, IDI and EMMs install the work keys and contracts,
+// and are sent by every tuner on its own handle, since a new card handle starts from the card image without them (CL mode)
+// A command counts as an error unless it returns SW1 0x90 and, when the response has one, the return code 0x0800 or 0x2100
+// Run with: tuner_load [options] library trace.trc  (see usage())
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "pcsc_loader.h"
+#include "trace.h"
+
+using namespace std;
+
+static const uint32_t ECM_PERIOD_MS = 100;  // ECM interval in broadcast time
+
+enum { KIND_INT, KIND_IDI, KIND_ECM, KIND_EMM, KIND_CHK, KIND_COUNT };
+static const char *KIND_NAME[ KIND_COUNT ] = { "INT", "IDI", "ECM", "EMM", "CHK" };
+
+typedef struct {
+    vector<uint32_t> tuners;
+    uint32_t seconds;
+    uint32_t speed;          // Broadcast clock acceleration (0: no pacing)
+    uint32_t emmInterval;    // ms of broadcast time
+    uint32_t emmBurst;
+    uint32_t chkInterval;    // ms of broadcast time
+    bool histogram;
+    const char *library;
+    const char *trace;
+} OPTIONS_t;
+
+// Log-linear latency histogram (16 buckets per power of two, about 6% resolution)
+class Histogram {
+public:
+    static const int SUB_BITS = 4;
+    static const int SUB = 1 << SUB_BITS;
+    static const int BUCKETS = (64 - SUB_BITS + 1) * SUB;
+
+    void add(uint64_t ns)
+    {
+        bucket[ index(ns) ]++;
+        count++;
+        if (ns > max) max = ns;
+    }
+
+    void merge(const Histogram &h)
+    {
+        for (int i = 0; i < BUCKETS; i++) bucket[ i ] += h.bucket[ i ];
+        count += h.count;
+        if (h.max > max) max = h.max;
+    }
+
+    // Upper bound of the bucket holding the p-th fraction of the samples
+    uint64_t percentile(double p) const
+    {
+        uint64_t target = (uint64_t)(p * count);
+        uint64_t sum = 0;
+        for (int i = 0; i < BUCKETS; i++) {
+            sum += bucket[ i ];
+            if (sum > target) return (upper(i) < max) ? upper(i) : max;
+        }
+        return max;
+    }
+
+    static uint64_t upper(int i)
+    {
+        if (i < SUB) return (uint64_t)i;
+        int e = i / SUB + SUB_BITS - 1;
+        return ((uint64_t)(i % SUB + SUB + 1) << (e - SUB_BITS)) - 1;
+    }
+
+    uint64_t bucket[ BUCKETS ] = {};
+    uint64_t count = 0;
+    uint64_t max = 0;
+
+private:
+    static int index(uint64_t ns)
+    {
+        if (ns < SUB) return (int)ns;
+        int e = SUB_BITS;
+        while (ns >> (e + 1)) e++;
+        return (e - SUB_BITS + 1) * SUB + (int)((ns >> (e - SUB_BITS)) - SUB);
+    }
+};
+
+typedef struct {
+    Histogram latency[ KIND_COUNT ];
+    uint64_t errors;
+} TUNER_RESULT_t;
+
+static vector<Trace::APDU_t> setup;  // Leading INT, IDI and EMMs of the trace
+static vector<Trace::APDU_t> pool[ KIND_COUNT ];
+static atomic<bool> stopRequest(false);
+
+//------------------------------------------------------------------------------
+static void usage(void)
+{
+    fprintf(stderr,
+        "Usage: tuner_load [options] library trace.trc\n"
+        "  -t counts     Tuner counts to run, comma separated (default 1,2,4,8)\n"
+        "  -d seconds    Duration of each run (default 5)\n"
+        "  -a speed      Broadcast clock acceleration (default 100; 0: send back-to-back to find the saturation point)\n"
+        "  -e ms         EMM burst interval in broadcast time (default 10000)\n"
+        "  -b count      EMMs per burst (default 4)\n"
+        "  -c ms         CHK interval in broadcast time (default 5000)\n"
+        "  -H            Print the latency histograms of every run\n");
+    exit(1);
+}
+
+//------------------------------------------------------------------------------
+// Send a command and check that the card accepted it (result: record the latency and count a rejection as an error)
+static bool transmit(SCARDHANDLE hCard, const Trace::APDU_t &a, TUNER_RESULT_t *result, int kind)
+{
+    uint8_t res[ TRACE_APDU_MAX_LENGTH ];
+    DWORD resLength = sizeof(res);
+    auto t0 = chrono::steady_clock::now();
+    LONG ret = pSCardTransmit(hCard, NULL, a.command, a.commandLength, NULL, res, &resLength);
+    auto t1 = chrono::steady_clock::now();
+
+    bool accepted = (ret == SCARD_S_SUCCESS) && (resLength >= 2) && (res[ resLength - 2 ] == 0x90);
+    if (accepted && (resLength >= 8)) {
+        uint16_t returnCode = (uint16_t)((res[ 4 ] << 8) | res[ 5 ]);
+        accepted = (returnCode == 0x0800) || (returnCode == 0x2100);
+    }
+    if (result) {
+        result->latency[ kind ].add((uint64_t)chrono::duration_cast<chrono::nanoseconds>(t1 - t0).count());
+        if (!accepted) result->errors++;
+    }
+    return accepted;
+}
+
+//------------------------------------------------------------------------------
+static void tuner(const OPTIONS_t &opt, uint32_t id, TUNER_RESULT_t *result)
+{
+    SCARDCONTEXT hContext;
+    SCARDHANDLE hCard;
+    DWORD protocol;
+    if (pSCardEstablishContext(SCARD_SCOPE_USER, NULL, NULL, &hContext) != SCARD_S_SUCCESS) {
+        result->errors++;
+        return;
+    }
+    if (pSCardConnect(hContext, "CobaltCas", SCARD_SHARE_SHARED, SCARD_PROTOCOL_T1, &hCard, &protocol) != SCARD_S_SUCCESS) {
+        result->errors++;
+        pSCardReleaseContext(hContext);
+        return;
+    }
+
+    // Each card handle has its own card state, so every tuner installs the work keys and contracts itself
+    for (const Trace::APDU_t &a : setup) {
+        if (!transmit(hCard, a, NULL, 0)) result->errors++;
+    }
+
+    // Tuners start at different points of the streams, as if they were tuned to different services
+    size_t ecm = id * 7919, emm = id * 104729, chk = id;
+    uint32_t emmEvery = (opt.emmInterval + ECM_PERIOD_MS - 1) / ECM_PERIOD_MS;
+    uint32_t chkEvery = (opt.chkInterval + ECM_PERIOD_MS - 1) / ECM_PERIOD_MS;
+    auto period = chrono::nanoseconds(opt.speed ? (uint64_t)ECM_PERIOD_MS * 1000000 / opt.speed : 0);
+    auto next = chrono::steady_clock::now();
+
+    for (uint32_t tick = 1; !stopRequest; tick++) {
+        transmit(hCard, pool[ KIND_ECM ][ ecm++ % pool[ KIND_ECM ].size() ], result, KIND_ECM);
+        if (!pool[ KIND_EMM ].empty() && emmEvery && (tick % emmEvery == 0)) {
+            for (uint32_t i = 0; i < opt.emmBurst; i++) {
+                transmit(hCard, pool[ KIND_EMM ][ emm++ % pool[ KIND_EMM ].size() ], result, KIND_EMM);
+            }
+        }
+        if (!pool[ KIND_CHK ].empty() && chkEvery && (tick % chkEvery == 0)) {
+            transmit(hCard, pool[ KIND_CHK ][ chk++ % pool[ KIND_CHK ].size() ], result, KIND_CHK);
+        }
+        if (opt.speed) {
+            next += period;
+            this_thread::sleep_until(next);
+        }
+    }
+
+    pSCardDisconnect(hCard, SCARD_LEAVE_CARD);
+    pSCardReleaseContext(hContext);
+}
+
+//------------------------------------------------------------------------------
+static void print_histogram(const Histogram &h, const char *name)
+{
+    printf("  %s latency histogram (us: count)\n", name);
+    for (int i = 0; i < Histogram::BUCKETS; i++) {
+        if (h.bucket[ i ]) printf("    <= %10.2f: %llu\n", Histogram::upper(i) / 1000.0, (unsigned long long)h.bucket[ i ]);
+    }
+}
+
+//==============================================================================
+int main(int argc, char *argv[])
+{
+    OPTIONS_t opt;
+    opt.tuners = { 1, 2, 4, 8 };
+    opt.seconds = 5;
+    opt.speed = 100;
+    opt.emmInterval = 10000;
+    opt.emmBurst = 4;
+    opt.chkInterval = 5000;
+    opt.histogram = false;
+    opt.library = NULL;
+    opt.trace = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[ i ];
+        if ((arg[0] != '-') || !arg[1]) {
+            if (!opt.library) {
+                opt.library = arg;
+            } else {
+                opt.trace = arg;
+            }
+            continue;
+        }
+        if (arg[1] == 'H') {
+            opt.histogram = true;
+            continue;
+        }
+        if (i + 1 >= argc) usage();
+        const char *val = argv[ ++i ];
+        switch (arg[1]) {
+            case 't':
+                opt.tuners.clear();
+                for (const char *p = val; *p;) {
+                    char *end;
+                    opt.tuners.push_back((uint32_t)strtoul(p, &end, 10));
+                    if ((end == p) || !opt.tuners.back()) usage();
+                    p = (*end == ',') ? end + 1 : end;
+                }
+                break;
+            case 'd': opt.seconds = (uint32_t)strtoul(val, NULL, 10); break;
+            case 'a': opt.speed = (uint32_t)strtoul(val, NULL, 10); break;
+            case 'e': opt.emmInterval = (uint32_t)strtoul(val, NULL, 10); break;
+            case 'b': opt.emmBurst = (uint32_t)strtoul(val, NULL, 10); break;
+            case 'c': opt.chkInterval = (uint32_t)strtoul(val, NULL, 10); break;
+            default: usage();
+        }
+    }
+    if (!opt.library || !opt.trace || opt.tuners.empty()) usage();
+
+    // Read the trace
+    FILE *fp = fopen(opt.trace, "rb");
+    if (!fp || !Trace::read_header(fp)) {
+        fprintf(stderr, "Not a trace file: %s\n", opt.trace);
+        return 1;
+    }
+    Trace::APDU_t a;
+    bool setupPart = true;
+    while (Trace::read_record(fp, &a)) {
+        setupPart = setupPart && ((a.command[ 1 ] == 0x30) || (a.command[ 1 ] == 0x32) || (a.command[ 1 ] == 0x36));
+        if (setupPart) setup.push_back(a);
+        switch (a.command[ 1 ]) {
+            case 0x30: pool[ KIND_INT ].push_back(a); break;
+            case 0x32: pool[ KIND_IDI ].push_back(a); break;
+            case 0x34: pool[ KIND_ECM ].push_back(a); break;
+            case 0x36: pool[ KIND_EMM ].push_back(a); break;
+            case 0x3c: pool[ KIND_CHK ].push_back(a); break;
+            default: break;
+        }
+    }
+    fclose(fp);
+    if (pool[ KIND_INT ].empty() || pool[ KIND_IDI ].empty() || pool[ KIND_ECM ].empty()) {
+        fprintf(stderr, "The trace needs INT, IDI and ECM commands (make one with traffic_gen)\n");
+        return 1;
+    }
+
+    if (!load_pcsc_library(opt.library)) {
+        fprintf(stderr, "Cannot load the PC/SC functions from %s\n", opt.library);
+        return 1;
+    }
+
+    printf("CobaltCas multi-tuner load: %u s per run, ", opt.seconds);
+    if (opt.speed) {
+        printf("broadcast clock x%u (ECM every %.3f ms per tuner)\n", opt.speed, (double)ECM_PERIOD_MS / opt.speed);
+    } else {
+        printf("no pacing (saturation)\n");
+    }
+    printf("EMM burst of %u every %u ms, CHK every %u ms (broadcast time)\n\n", opt.emmBurst, opt.emmInterval, opt.chkInterval);
+    printf("tuners   commands/s  errors   ECM p50/p99 us       EMM p50/p99 us       CHK p50/p99 us\n");
+
+    for (uint32_t n : opt.tuners) {
+        vector<TUNER_RESULT_t> results(n);
+        vector<thread> threads;
+        for (TUNER_RESULT_t &r : results) r.errors = 0;
+
+        stopRequest = false;
+        auto start = chrono::steady_clock::now();
+        for (uint32_t i = 0; i < n; i++) {
+            threads.emplace_back(tuner, cref(opt), i, &results[ i ]);
+        }
+        this_thread::sleep_for(chrono::seconds(opt.seconds));
+        stopRequest = true;
+        for (thread &t : threads) t.join();
+        double seconds = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count() / 1e9;
+
+        Histogram total[ KIND_COUNT ];
+        uint64_t commands = 0, errors = 0;
+        for (const TUNER_RESULT_t &r : results) {
+            for (int k = 0; k < KIND_COUNT; k++) {
+                total[ k ].merge(r.latency[ k ]);
+                commands += r.latency[ k ].count;
+            }
+            errors += r.errors;
+        }
+
+        printf("%6u %12.0f %7llu", n, commands / seconds, (unsigned long long)errors);
+        for (int k = KIND_ECM; k <= KIND_CHK; k++) {
+            if (total[ k ].count) {
+                printf("   %8.2f /%9.2f", total[ k ].percentile(0.50) / 1000.0, total[ k ].percentile(0.99) / 1000.0);
+            } else {
+                printf("   %8s /%9s", "-", "-");
+            }
+        }
+        printf("\n");
+
+        if (opt.histogram) {
+            for (int k = KIND_ECM; k <= KIND_CHK; k++) {
+                if (total[ k ].count) print_histogram(total[ k ], KIND_NAME[ k ]);
+            }
+            printf("\n");
+        }
+    }
+
+    return 0;
+}